@@ -0,0 +1,110 @@
+#include "assets.hh"
+#include <fstream>
+#include <mutex>
+#include <cstdio>
+
+constexpr int asset_max_age = 7 * 24 * 60 * 60;
+
+std::mutex assets_lock;
+std::shared_ptr<const asset_map> current_assets = std::make_shared<asset_map>();
+
+inline bool read_file(const std::string &path, std::vector<unsigned char> &out) {
+    std::ifstream is(path, std::ios::binary);
+
+    if (!is)
+        return false;
+
+    out.assign(std::istreambuf_iterator<char>(is), {});
+    return true;
+}
+
+inline std::string content_type(const std::string &path) {
+    static const std::pair<const char *, const char *> types[] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".css", "text/css; charset=utf-8" },
+        { ".js", "application/javascript; charset=utf-8" },
+        { ".png", "image/png" },
+    };
+
+    for (auto &t : types) {
+        size_t n = std::char_traits<char>::length(t.first);
+
+        if (path.size() >= n && !path.compare(path.size() - n, n, t.first))
+            return t.second;
+    }
+
+    return "application/octet-stream";
+}
+
+// Strong validator derived from the content (64-bit FNV-1a)
+inline std::string make_etag(const std::vector<unsigned char> &data) {
+    size_t h = 0xcbf29ce484222325ull;
+
+    for (unsigned char c : data)
+        h = (h ^ c) * 0x100000001b3ull;
+
+    char buf[24];
+    std::snprintf(buf, sizeof buf, "\"%016llx\"", (unsigned long long)h);
+    return buf;
+}
+
+bool assets::load(const std::string &root, const char *const *paths, int count) {
+    auto map = std::make_shared<asset_map>();
+
+    for (int i = 0; i < count; i++) {
+        std::string path = paths[i];
+        std::string file = root + (path == "/" ? "/index.html" : path);
+        static_asset asset;
+
+        if (!read_file(file, asset.identity))
+            return false;
+
+        read_file(file + ".gz", asset.gzip);
+        read_file(file + ".br", asset.brotli);
+
+        asset.etag = make_etag(asset.identity);
+        asset.content_type = content_type(file);
+
+        // Pages are revalidated on every visit, everything else is cached for a week
+        asset.cache_control = asset.content_type.rfind("text/html", 0) == 0 ?
+            "no-cache" : "public, max-age=" + std::to_string(asset_max_age);
+
+        (*map)[path] = std::move(asset);
+    }
+
+    std::lock_guard<std::mutex> guard(assets_lock);
+    current_assets = map;
+    return true;
+}
+
+std::shared_ptr<const asset_map> assets::snapshot() {
+    std::lock_guard<std::mutex> guard(assets_lock);
+    return current_assets;
+}
+
+const std::vector<unsigned char> &assets::select(const static_asset &asset, const std::string &accept_encoding,
+    const char *&encoding) {
+    encoding = nullptr;
+
+    if (!asset.brotli.empty() && asset.brotli.size() < asset.identity.size() &&
+        accept_encoding.find("br") != std::string::npos) {
+        encoding = "br";
+        return asset.brotli;
+    }
+
+    if (!asset.gzip.empty() && asset.gzip.size() < asset.identity.size() &&
+        accept_encoding.find("gzip") != std::string::npos) {
+        encoding = "gzip";
+        return asset.gzip;
+    }
+
+    return asset.identity;
+}
+
+std::string assets::etag(const static_asset &asset, const char *encoding) {
+    if (!encoding)
+        return asset.etag;
+
+    // Inside the quotes of the identity's tag
+    return asset.etag.substr(0, asset.etag.size() - 1) + '-' + encoding + '"';
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+struct static_asset {
+    std::vector<unsigned char> identity, gzip, brotli;
+    std::string etag, content_type, cache_control;
+};
+
+using asset_map = std::unordered_map<std::string, static_asset>;
+
+// Immutable in-memory copies of the static files, replaced as a whole on reload
+namespace assets
+{
+    // Reads every path under root, along with precompressed path.gz and path.br variants if present
+    bool load(const std::string &root, const char *const *paths, int count);
+
+    std::shared_ptr<const asset_map> snapshot();
+
+    // Picks the smallest representation the client accepts, returns the Content-Encoding or nullptr
+    const std::vector<unsigned char> &select(const static_asset &asset, const std::string &accept_encoding,
+        const char *&encoding);
+
+    // Every encoding is a representation of its own and gets its own validator
+    std::string etag(const static_asset &asset, const char *encoding);
+}
@@ -0,0 +1,64 @@
+#include "async.hh"
+#include "logger.hh"
+
+thread_executor::thread_executor(int threads)
+{
+    for (int i = 0; i < threads; i++)
+        this->threads.emplace_back(&thread_executor::work, this);
+}
+
+thread_executor::~thread_executor()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    ready.notify_all();
+
+    for (auto &thread : threads)
+        thread.join();
+}
+
+void thread_executor::post(std::function<void()> work)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(std::move(work));
+    }
+
+    ready.notify_one();
+}
+
+void thread_executor::work()
+{
+    for (;;) {
+        std::function<void()> next;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [this] { return stopping || !queue.empty(); });
+
+            if (stopping)
+                return;
+
+            next = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        next();
+    }
+}
+
+void detached_task::promise_type::unhandled_exception() noexcept
+{
+    try {
+        throw;
+    }
+    catch (const std::exception &e) {
+        logger::write(log_level::error, "handler_failed", { { "what", e.what() } });
+    }
+    catch (...) {
+        logger::write(log_level::error, "handler_failed");
+    }
+}
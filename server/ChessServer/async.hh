@@ -0,0 +1,91 @@
+#pragma once
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Pieces for handlers written as C++20 coroutines. A handler suspends while
+// it waits for the network or the engine, holding no thread, and whoever
+// finishes the work posts the rest of the handler to an executor
+
+// Somewhere to run work
+class executor {
+public:
+    virtual ~executor() = default;
+    virtual void post(std::function<void()> work) = 0;
+};
+
+// Threads of its own that take work in order of arrival. Work still queued
+// when it's destroyed is dropped
+class thread_executor : public executor {
+public:
+    explicit thread_executor(int threads);
+    ~thread_executor();
+
+    void post(std::function<void()> work) override;
+
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> queue;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+    void work();
+};
+
+// Return type of a coroutine nobody waits for: it starts right away and its
+// frame is freed when it finishes. Exceptions that escape it are logged
+struct detached_task {
+    struct promise_type {
+        inline detached_task get_return_object() noexcept { return {}; }
+        inline std::suspend_never initial_suspend() noexcept { return {}; }
+        inline std::suspend_never final_suspend() noexcept { return {}; }
+        inline void return_void() noexcept {}
+        void unhandled_exception() noexcept;
+    };
+};
+
+// co_await run_on(compute, resume, work) runs work on compute and continues the
+// coroutine on resume with work's result, or rethrows what work threw
+template<class F> auto run_on(executor &compute, executor &resume, F work)
+{
+    using result_type = std::invoke_result_t<F &>;
+
+    struct awaiter {
+        executor &compute, &resume;
+        F work;
+        std::optional<result_type> result;
+        std::exception_ptr error;
+
+        inline bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> coroutine) {
+            compute.post([this, coroutine] {
+                try {
+                    result.emplace(work());
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+
+                resume.post([coroutine] { coroutine.resume(); });
+            });
+        }
+
+        result_type await_resume() {
+            if (error)
+                std::rethrow_exception(error);
+
+            return std::move(*result);
+        }
+    };
+
+    return awaiter{ compute, resume, std::move(work) };
+}
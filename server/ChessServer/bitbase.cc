@@ -0,0 +1,275 @@
+#include "bitbase.hh"
+#include "lookups.hh"
+#include <cstdint>
+#include <cstring>
+
+// KPK positions are normalized so that the pawn belongs to side 1, advances towards y = 0,
+// and stands on files a-d; index = strong to move + 2 * (strong king + 64 * (weak king + 64 * pawn))
+constexpr int kpk_size = 2 * 64 * 64 * 24;
+
+// KRK positions with the strong side to move, index = strong king + 64 * (weak king + 64 * rook)
+constexpr int krk_size = 64 * 64 * 64;
+constexpr uint8_t krk_draw = 255;
+
+uint32_t kpk_bits[kpk_size / 32];
+uint8_t krk_dtm[krk_size];
+
+inline int lsb(bits b) {
+    unsigned long ind;
+    _BitScanForward64(&ind, b);
+    return int(ind);
+}
+
+inline bits king_attacks(int sq) { return capture_masks[sq][king]; }
+inline bits rook_attacks(int sq, bits occupied) { return sliding_attacks(sq, occupied, 2, 4); }
+inline bool adjacent(int a, int b) { return king_attacks(a) >> b & 1; }
+
+inline int kpk_index(bool strong_to_move, int strong_king, int weak_king, int pawn_sq) {
+    int p = ((pawn_sq >> 3) - 1) * 4 + (pawn_sq & 7);
+    return strong_to_move + 2 * (strong_king + 64 * (weak_king + 64 * p));
+}
+
+inline int krk_index(int strong_king, int weak_king, int rook_sq) {
+    return strong_king + 64 * (weak_king + 64 * rook_sq);
+}
+
+enum : uint8_t { kpk_invalid = 0, kpk_unknown = 1, kpk_draw = 2, kpk_win = 4 };
+
+void generate_kpk() {
+    std::vector<uint8_t> db(kpk_size, kpk_invalid);
+
+    for (int p = 0; p < 24; p++) {
+        int pawn_sq = (p / 4 + 1) * 8 + p % 4;
+        bits pawn_attacks = pawn_capture_masks[1][pawn_sq];
+
+        for (int wk = 0; wk < 64; wk++) {
+            for (int sk = 0; sk < 64; sk++) {
+                if (sk == wk || sk == pawn_sq || wk == pawn_sq || adjacent(sk, wk))
+                    continue;
+
+                for (int stm = 0; stm <= 1; stm++) {
+                    uint8_t &r = db[kpk_index(stm, sk, wk, pawn_sq)];
+
+                    // The weak king can't be in check with the strong side to move
+                    if (stm && pawn_attacks >> wk & 1)
+                        continue;
+
+                    r = kpk_unknown;
+
+                    if (stm && pawn_sq >> 3 == 1) {
+                        // Promotion that can't be stopped
+                        int promo = pawn_sq - 8;
+
+                        if (promo != sk && promo != wk && (!adjacent(wk, promo) || adjacent(sk, promo)))
+                            r = kpk_win;
+                    }
+                    else if (!stm) {
+                        // Stalemate, or the pawn falls
+                        bits escapes = king_attacks(wk) & ~(king_attacks(sk) | pawn_attacks);
+
+                        if (!escapes || escapes & (1ull << pawn_sq) & ~king_attacks(sk))
+                            r = kpk_draw;
+                    }
+                }
+            }
+        }
+    }
+
+    // Classify until nothing changes, unresolved positions are draws
+    for (bool repeat = true; repeat; ) {
+        repeat = false;
+
+        for (int idx = 0; idx < kpk_size; idx++) {
+            if (db[idx] != kpk_unknown)
+                continue;
+
+            int stm = idx & 1, sk = idx >> 1 & 63, wk = idx >> 7 & 63, p = idx >> 13;
+            int pawn_sq = (p / 4 + 1) * 8 + p % 4;
+            uint8_t r = kpk_invalid;
+
+            if (stm) {
+                for (bits b = king_attacks(sk); b; b &= b - 1) {
+                    int to = lsb(b);
+                    if (to != pawn_sq) r |= db[kpk_index(0, to, wk, pawn_sq)];
+                }
+
+                int push = pawn_sq - 8;
+
+                if (push >> 3 >= 1 && push != sk && push != wk) {
+                    r |= db[kpk_index(0, sk, wk, push)];
+
+                    if (pawn_sq >> 3 == 6 && push - 8 != sk && push - 8 != wk)
+                        r |= db[kpk_index(0, sk, wk, push - 8)];
+                }
+
+                r = r & kpk_win ? kpk_win : r & kpk_unknown ? kpk_unknown : kpk_draw;
+            }
+            else {
+                for (bits b = king_attacks(wk); b; b &= b - 1) {
+                    int to = lsb(b);
+                    if (to != pawn_sq) r |= db[kpk_index(1, sk, to, pawn_sq)];
+                }
+
+                r = r & kpk_draw ? kpk_draw : r & kpk_unknown ? kpk_unknown : kpk_win;
+            }
+
+            if (r != kpk_unknown) {
+                db[idx] = r;
+                repeat = true;
+            }
+        }
+    }
+
+    for (int idx = 0; idx < kpk_size; idx++)
+        if (db[idx] == kpk_win)
+            kpk_bits[idx >> 5] |= 1u << (idx & 31);
+}
+
+void generate_krk() {
+    // Weak side to move positions only exist during generation
+    std::vector<uint8_t> weak_dtm(krk_size, krk_draw), moves_left(krk_size, 0);
+    std::vector<int> queue;
+    queue.reserve(krk_size);
+
+    std::memset(krk_dtm, krk_draw, sizeof krk_dtm);
+
+    for (int rook_sq = 0; rook_sq < 64; rook_sq++) {
+        for (int wk = 0; wk < 64; wk++) {
+            for (int sk = 0; sk < 64; sk++) {
+                if (sk == wk || sk == rook_sq || wk == rook_sq || adjacent(sk, wk))
+                    continue;
+
+                int idx = krk_index(sk, wk, rook_sq);
+
+                // The weak king's old square doesn't block the rook
+                bits attacked = king_attacks(sk) | rook_attacks(rook_sq, 1ull << sk);
+                bits escapes = king_attacks(wk) & ~attacked & ~(1ull << sk);
+                bool in_check = rook_attacks(rook_sq, 1ull << sk | 1ull << wk) >> wk & 1;
+
+                // Capturing an undefended rook draws
+                if (escapes >> rook_sq & 1)
+                    continue;
+
+                if (escapes)
+                    moves_left[idx] = uint8_t(__popcnt64(escapes));
+                else if (in_check) {
+                    weak_dtm[idx] = 0;
+                    queue.push_back(idx * 2);
+                }
+            }
+        }
+    }
+
+    // Breadth-first from the mates; even entries are weak to move, odd are strong to move
+    for (size_t head = 0; head < queue.size(); head++) {
+        int idx = queue[head] >> 1;
+        bool strong_to_move = queue[head] & 1;
+        int sk = idx & 63, wk = idx >> 6 & 63, rook_sq = idx >> 12;
+        bits occupied = 1ull << sk | 1ull << wk | 1ull << rook_sq;
+
+        if (!strong_to_move) {
+            int dtm = weak_dtm[idx] + 1;
+
+            auto reach = [&](int from_sk, int from_rook) {
+                // The previous position must not have had the weak king in check
+                if (rook_attacks(from_rook, 1ull << from_sk | 1ull << wk) >> wk & 1)
+                    return;
+
+                uint8_t &d = krk_dtm[krk_index(from_sk, wk, from_rook)];
+
+                if (d == krk_draw) {
+                    d = uint8_t(dtm);
+                    queue.push_back(krk_index(from_sk, wk, from_rook) * 2 + 1);
+                }
+            };
+
+            for (bits b = king_attacks(sk) & ~occupied & ~king_attacks(wk); b; b &= b - 1)
+                reach(lsb(b), rook_sq);
+
+            for (bits b = rook_attacks(rook_sq, occupied) & ~occupied; b; b &= b - 1)
+                reach(sk, lsb(b));
+        }
+        else {
+            int dtm = krk_dtm[idx] + 1;
+
+            for (bits b = king_attacks(wk) & ~occupied & ~king_attacks(sk); b; b &= b - 1) {
+                int prev = krk_index(sk, lsb(b), rook_sq);
+
+                if (moves_left[prev] && !--moves_left[prev]) {
+                    weak_dtm[prev] = uint8_t(dtm);
+                    queue.push_back(prev * 2);
+                }
+            }
+        }
+    }
+}
+
+void bitbase::init() {
+    generate_kpk();
+    generate_krk();
+}
+
+inline int krk_weak_to_move(int sk, int wk, int rook_sq) {
+    bits attacked = king_attacks(sk) | rook_attacks(rook_sq, 1ull << sk);
+    bits escapes = king_attacks(wk) & ~attacked & ~(1ull << sk);
+
+    if (escapes >> rook_sq & 1)
+        return krk_draw;
+
+    if (!escapes)
+        return rook_attacks(rook_sq, 1ull << sk | 1ull << wk) >> wk & 1 ? 0 : krk_draw;
+
+    int worst = 0;
+
+    for (; escapes; escapes &= escapes - 1) {
+        int d = krk_dtm[krk_index(sk, lsb(escapes), rook_sq)];
+
+        if (d == krk_draw)
+            return krk_draw;
+
+        worst = std::max(worst, d + 1);
+    }
+
+    return worst;
+}
+
+bool bitbase::probe(const chessboard &board, int &score) {
+    bits all = board.side_sets[0] | board.side_sets[1];
+
+    if (__popcnt64(all) != 3)
+        return false;
+
+    bits extra = all & ~board.piece_sets[king];
+    int strong = (board.side_sets[1] & extra) != 0;
+    int sk = lsb(board.piece_sets[king] & board.side_sets[strong]);
+    int wk = lsb(board.piece_sets[king] & board.side_sets[strong ^ 1]);
+    int sq = lsb(extra);
+    bool strong_to_move = board.side_to_move == strong;
+    int value;
+
+    if (extra & board.piece_sets[pawn]) {
+        // Side 0 pawns advance towards y = 7, flip the board vertically
+        if (!strong)
+            sk ^= 56, wk ^= 56, sq ^= 56;
+
+        // Mirror the pawn onto files a-d
+        if ((sq & 7) >= 4)
+            sk ^= 7, wk ^= 7, sq ^= 7;
+
+        int idx = kpk_index(strong_to_move, sk, wk, sq);
+
+        if (!(kpk_bits[idx >> 5] >> (idx & 31) & 1))
+            value = 0;
+        else
+            value = known_win + piece_values[pawn] + 8 * (7 - (sq >> 3));
+    }
+    else if (extra & board.piece_sets[rook]) {
+        int dtm = strong_to_move ? krk_dtm[krk_index(sk, wk, sq)] : krk_weak_to_move(sk, wk, sq);
+        value = dtm == krk_draw ? 0 : known_win + piece_values[rook] - dtm;
+    }
+    else
+        return false;
+
+    score = strong_to_move ? value : -value;
+    return true;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "chess.hh"
+
+// In-memory endgame bitbases generated by retrograde analysis at startup:
+// KPK as win/draw bits and KRK as distance to mate
+namespace bitbase
+{
+    // Scores for known wins, far above any material balance but below tablebase wins
+    constexpr int known_win = 10000;
+
+    void init();
+
+    // Exact score for the side to move if the material signature is covered
+    bool probe(const chessboard &board, int &score);
+}
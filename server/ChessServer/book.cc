@@ -0,0 +1,196 @@
+#include "book.hh"
+#include "mapped_file.hh"
+#include "lookups.hh"
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <random>
+
+constexpr int polyglot_castle_offset = 768;
+constexpr int polyglot_en_passant_offset = 772;
+constexpr int polyglot_turn_offset = 780;
+constexpr int polyglot_key_count = 781;
+
+// Polyglot key of the standard starting position, used to validate the loaded keys
+constexpr size_t polyglot_start_key = 0x463b96181691fc9cull;
+
+struct book_entry {
+    size_t key;
+    int move, weight;
+};
+
+bits polyglot_random[polyglot_key_count];
+bool keys_loaded = false;
+mapped_file book_file;
+
+// Entries are stored as big-endian (key, move, weight, learn) records of 16 bytes each
+inline size_t read_be(const unsigned char *p, int bytes) {
+    size_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+inline book_entry read_entry(size_t index) {
+    const unsigned char *p = book_file.data() + index * 16;
+    return book_entry{ read_be(p, 8), int(read_be(p + 8, 2)), int(read_be(p + 10, 2)) };
+}
+
+inline size_t entry_count() {
+    return book_file.size() / 16;
+}
+
+// Polyglot numbers pieces as (pawn, knight, bishop, rook, queen, king) x (black, white)
+inline int polyglot_piece(int piece) {
+    static const int kinds[pawn + 1] = { 0, 5, 4, 2, 1, 3, 0 };
+    return kinds[piece & type_mask] * 2 + (piece >> side_shift);
+}
+
+size_t book::polyglot_key(const chessboard &board) {
+    size_t key = 0;
+
+    for (int i = 0; i < 64; i++) {
+        if (int p = board.pieces[i]) {
+            // Side 1 (white) starts on y = 7, which is Polyglot's row 0
+            int file = i & 7, row = 7 - (i >> 3);
+            key ^= polyglot_random[64 * polyglot_piece(p) + 8 * row + file];
+        }
+    }
+
+    for (int side = 0; side <= 1; side++) {
+        int base = polyglot_castle_offset + (side ? 0 : 2);
+
+        if (board.castling & castle_kingside(side))
+            key ^= polyglot_random[base];
+
+        if (board.castling & castle_queenside(side))
+            key ^= polyglot_random[base + 1];
+    }
+
+    // En passant counts only if a pawn can actually capture
+    int side = board.side_to_move;
+
+    if (board.en_passant &&
+        pawn_capture_masks[side ^ 1][board.en_passant] & board.piece_sets[pawn] & board.side_sets[side])
+        key ^= polyglot_random[polyglot_en_passant_offset + (board.en_passant & 7)];
+
+    if (board.side_to_move == 1)
+        key ^= polyglot_random[polyglot_turn_offset];
+
+    return key;
+}
+
+bool book::load_keys(const std::string &path) {
+    std::ifstream is(path);
+    std::string token;
+    int count = 0;
+
+    while (count < polyglot_key_count && is >> token) {
+        size_t pos = token.find("0x");
+
+        if (pos == std::string::npos)
+            pos = token.find("0X");
+
+        if (pos == std::string::npos)
+            continue;
+
+        const char *digits = token.data() + pos + 2;
+        const char *end = digits + std::min<size_t>(token.size() - pos - 2, 16);
+        unsigned long long key;
+
+        // A corrupt file just leaves the book off
+        if (std::from_chars(digits, end, key, 16).ec != std::errc())
+            return keys_loaded = false;
+
+        polyglot_random[count++] = key;
+    }
+
+    if (count != polyglot_key_count)
+        return keys_loaded = false;
+
+    chessboard start;
+    const char *layout = "5432134566666666" "00000000000000000000000000000000" "eeeeeeeedcba9bcd";
+
+    for (int i = 0; i < 64; i++) {
+        int data = layout[i] >= 'a' ? layout[i] - 'a' + 10 : layout[i] - '0';
+        start.pieces[i] = data;
+    }
+
+    return keys_loaded = polyglot_key(start) == polyglot_start_key;
+}
+
+bool book::open(const std::string &path) {
+    return keys_loaded && book_file.open(path) && entry_count();
+}
+
+bool book::probe(chessboard &board, chessmove &move, int max_ply, bool deterministic) {
+    if (!book_file.is_open() || board.move_count >= max_ply)
+        return false;
+
+    size_t key = polyglot_key(board);
+
+    // Binary search for the first entry with this key
+    size_t lo = 0, hi = entry_count();
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (read_entry(mid).key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    bits legal_moves[64] = { 0 };
+    board.generate_moves(board.side_to_move, legal_moves);
+
+    std::vector<std::pair<chessmove, int>> candidates;
+    int total_weight = 0;
+
+    for (size_t i = lo; i < entry_count(); i++) {
+        book_entry e = read_entry(i);
+
+        if (e.key != key)
+            break;
+
+        int to_file = e.move & 7, to_row = e.move >> 3 & 7;
+        int from_file = e.move >> 6 & 7, from_row = e.move >> 9 & 7;
+        int promotion = e.move >> 12 & 7;
+
+        // Underpromotions can't be played, we always promote to a queen
+        if (!e.weight || (promotion && promotion != 4))
+            continue;
+
+        chessmove m;
+        m.org_x = from_file, m.org_y = 7 - from_row;
+        m.dest_x = to_file, m.dest_y = 7 - to_row;
+
+        // Castling is encoded as the king capturing its own rook
+        if ((board.pieces[m.org_x + m.org_y * 8] & type_mask) == king && m.org_x == 4 &&
+            m.org_y == m.dest_y && (m.dest_x == 0 || m.dest_x == 7))
+            m.dest_x = m.dest_x ? 6 : 2;
+
+        // Guard against key collisions
+        if (~legal_moves[m.org_x + m.org_y * 8] & 1ull << (m.dest_x + m.dest_y * 8))
+            continue;
+
+        candidates.push_back({ m, e.weight });
+        total_weight += e.weight;
+    }
+
+    if (candidates.empty())
+        return false;
+
+    thread_local std::mt19937 rng(std::random_device{}());
+    std::mt19937 seeded(unsigned(board.hash ^ board.hash >> 32));
+    int pick = std::uniform_int_distribution<int>(0, total_weight - 1)(deterministic ? seeded : rng);
+
+    for (auto &c : candidates) {
+        if ((pick -= c.second) < 0) {
+            move = c.first;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "chess.hh"
+
+namespace book
+{
+    // Loads the 781 Random64 keys of the Polyglot specification from a text file
+    // (any file listing them as 0x... literals in order, e.g. the reference C source)
+    bool load_keys(const std::string &path);
+
+    // Memory-maps a Polyglot .bin book, requires the keys to be loaded first
+    bool open(const std::string &path);
+
+    size_t polyglot_key(const chessboard &board);
+
+    // Picks a book move for the current position, weighted by the entries' weights.
+    // Deterministic picks depend on the position alone
+    bool probe(chessboard &board, chessmove &move, int max_ply = 20, bool deterministic = false);
+}
@@ -1,5 +1,5 @@
 #include "chess.hh"
-#include <random>
+#include "lookups.hh"
 
 template<typename T> int sgn(T val) {
     return (T(0) < val) - (val < T(0));
@@ -9,106 +9,73 @@ template<typename T> int between(T x, T a, T b) {
     return a <= x && x < b;
 }
 
-bits zobrist_table[64][16];
-bits capture_masks[64][6];
-sliding_mask bishop_masks[64][2][2];
-sliding_mask rook_masks[64][2][2];
-const sliding_mask *masks_fw[64][4];
-const sliding_mask *masks_rev[64][4];
+const int piece_values[pawn + 1] = { 0, 0, 1025, 365, 337, 477, 82 };
 
-void init_lookups() {
-    std::memset(capture_masks, 0, sizeof(capture_masks));
-    std::memset(bishop_masks, 0, sizeof(bishop_masks));
-    std::memset(rook_masks, 0, sizeof(rook_masks));
-
-    //std::random_device rd;
-    std::mt19937_64 e(339532);
+size_t zobrist_fingerprint() {
+    size_t digest = 0;
 
     for (int i = 0; i < 64; i++)
         for (int j = 0; j < 16; j++)
-            zobrist_table[i][j] = e();
+            digest = (digest << 7 | digest >> 57) ^ zobrist_table[i][j];
 
-    for (int i = 0; i < 64; i++) {
-        masks_fw[i][0] = &bishop_masks[i][0][1];
-        masks_fw[i][1] = &bishop_masks[i][1][1];
-        masks_fw[i][2] = &rook_masks[i][1][0];
-        masks_fw[i][3] = &rook_masks[i][1][1];
-        masks_rev[i][0] = &bishop_masks[i][0][0];
-        masks_rev[i][1] = &bishop_masks[i][1][0];
-        masks_rev[i][2] = &rook_masks[i][0][0];
-        masks_rev[i][3] = &rook_masks[i][0][1];
+    return digest;
+}
+
+// Rights that end when anything moves from or to a square, kings and rooks on their original squares
+constexpr std::array<int, 64> generate_castling_masks() {
+    std::array<int, 64> masks {};
+
+    for (int i = 0; i < 64; i++)
+        masks[i] = all_castling;
+
+    for (int side = 0; side <= 1; side++) {
+        int y = side * 7 * 8;
+        masks[4 + y] &= ~(castle_kingside(side) | castle_queenside(side));
+        masks[7 + y] &= ~castle_kingside(side);
+        masks[0 + y] &= ~castle_queenside(side);
     }
 
-    int I = 0;
-
-    for (int y = 0; y < 8; y++) {
-        for (int x = 0; x < 8; x++, I++) {
-            auto a = [x, y](int i, int j) mutable {
-                i += x, j += y;
-                if ((i & 7) == i && (j & 7) == j)
-                    return 1ull << i + j * 8;
-                return 0ull;
-            };
-
-            for (int i = -2; i <= 2; i += 4)
-                for (int j = -1; j <= 1; j += 2) {
-                    capture_masks[I][knight] |= a(i, j);
-                    capture_masks[I][knight] |= a(j, i);
-                }
+    return masks;
+}
 
-            for (int i = 0; i <= 1; i++) {
-                for (int j = 0; j <= 1; j++) {
-                    int X = 0, Y = 0;
-                    bits M = 0;
-                    do {
-                        if (j) Y += i * 2 - 1;
-                        else X += i * 2 - 1;
-                        bits value = rook_masks[I][i][j].last |= M = a(X, Y);
-                        if (M) rook_masks[I][i][j].steps[(x + X) + (y + Y) * 8] = value;
-                    } while (M);
-                }
-            }
+constexpr std::array<int, 64> castling_masks = generate_castling_masks();
 
-            for (int i = 0; i <= 1; i++) {
-                for (int j = 0; j <= 1; j++) {
-                    int X = 0, Y = 0;
-                    bits M = 0;
-                    do {
-                        X += i * 2 - 1;
-                        Y += j * 2 - 1;
-                        bits value = bishop_masks[I][i][j].last |= M = a(X, Y);
-                        if (M) bishop_masks[I][i][j].steps[(x + X) + (y + Y) * 8] = value;
-                    } while (M);
-                }
-            }
+void chessboard::validate_castling() {
+    for (int side = 0; side <= 1; side++) {
+        int y = side * 7 * 8;
+        char k = king | side << side_shift, r = rook | side << side_shift;
 
-            for (int j = -1; j <= 1; j += 2) {
-                for (int i = -1; i <= 1; i++)
-                    capture_masks[I][king] |= a(i, j);
-                capture_masks[I][king] |= a(j, 0);
-            }
-        }
+        if (pieces[4 + y] != k || pieces[7 + y] != r)
+            castling &= ~castle_kingside(side);
+
+        if (pieces[4 + y] != k || pieces[0 + y] != r)
+            castling &= ~castle_queenside(side);
     }
 }
 
 void chessboard::make_move(int org_x, int org_y, int dest_x, int dest_y) {
+    chessmove m;
+    m.previous_castling = castling;
+    m.previous_en_passant = en_passant;
+    m.previous_halfmove_clock = halfmove_clock;
+    m.previous_checkers = checkers;
+
+    // The en passant key of the file is on while the last move was a double pawn step
+    if (en_passant)
+        hash ^= en_passant_keys[en_passant & 7];
+
+    en_passant = 0;
+    halfmove_clock++;
+
     if (!org_x && !org_y && !dest_x && !dest_y) {
         side_to_move ^= 1;
         hash ^= zobrist_table[1][8];
-        move_stack.push_back(chessmove());
+        checkers = find_checkers();
+        move_stack.push_back(m);
         move_count++;
         return;
     }
 
-    bool old_pawn_two_squares = false;
-
-    if (move_stack.size()) {
-        const auto &last = move_stack.back();
-        old_pawn_two_squares =
-            (pieces[last.dest_x + last.dest_y * 8] & type_mask) == pawn
-            && std::abs(last.org_y - last.dest_y) == 2;
-    }
-
     int org_ind = org_x + org_y * 8;
     int dest_ind = dest_x + dest_y * 8;
     bits org_mask = 1ull << org_ind;
@@ -117,17 +84,22 @@ void chessboard::make_move(int org_x, int org_y, int dest_x, int dest_y) {
     // Remove moving piece from its original location
     int org_type, org_side;
     int org = piecetype(org_x, org_y, org_type, org_side);
-    bool org_had_moved = has_moved & org_mask;
 
-    has_moved &= ~org_mask;
+    int rights = castling & castling_masks[org_ind] & castling_masks[dest_ind];
+    hash ^= castling_keys[castling ^ rights];
+    castling = rights;
 
     int delta_x = org_x - dest_x, delta_y = org_y - dest_y;
     int change_x = std::abs(delta_x), change_y = std::abs(delta_y);
 
-    bool two_squares_changed = (change_y == 2 && org_type == pawn) != old_pawn_two_squares;
+    if (org_type == pawn) {
+        halfmove_clock = 0;
 
-    if (two_squares_changed)
-        hash ^= zobrist_table[0][8];
+        if (change_y == 2) {
+            en_passant = dest_x + (org_y + dest_y) / 2 * 8;
+            hash ^= en_passant_keys[dest_x];
+        }
+    }
 
     // This is castling, move the rook
     if (org_type == king && change_x == 2) {
@@ -149,18 +121,18 @@ void chessboard::make_move(int org_x, int org_y, int dest_x, int dest_y) {
     if (!captured && org_type == pawn && change_x == 1)
         captured = piecetype(dest_x, captured_y = org_side ? dest_y + 1 : dest_y - 1, cap_type, cap_side);
 
-    int cap_ind = captured_x + captured_y * 8;
-    bits captured_mask = ~(1ull << cap_ind);
-    bool captured_had_moved = has_moved & ~captured_mask;
+    if (captured) {
+        int cap_ind = captured_x + captured_y * 8;
+        bits captured_mask = ~(1ull << cap_ind);
 
-    has_moved &= captured_mask;
-    side_sets[cap_side] &= captured_mask;
-    piece_sets[cap_type] &= captured_mask;
-    piecetype(captured_x, captured_y) = 0;
-    if (captured) hash ^= zobrist_table[cap_ind][captured];
+        side_sets[cap_side] &= captured_mask;
+        piece_sets[cap_type] &= captured_mask;
+        piecetype(captured_x, captured_y) = 0;
+        hash ^= zobrist_table[cap_ind][captured];
+        halfmove_clock = 0;
+    }
 
     // Place the moving piece in its new location
-    has_moved |= dest_mask;
     side_sets[org_side] ^= org_mask ^ dest_mask;
     piece_sets[org_type] ^= org_mask ^ dest_mask;
     piecetype(org_x, org_y) = 0;
@@ -180,15 +152,15 @@ void chessboard::make_move(int org_x, int org_y, int dest_x, int dest_y) {
 
     side_to_move ^= 1;
     hash ^= zobrist_table[1][8];
+    checkers = find_checkers();
 
     previous_states[hash]++;
 
-    move_stack.push_back(chessmove {
-        org_x, org_y, org_had_moved,
-        dest_x, dest_y,
-        captured_x, captured_y, captured, captured_had_moved,
-        promotion, two_squares_changed
-    });
+    m.org_x = org_x, m.org_y = org_y;
+    m.dest_x = dest_x, m.dest_y = dest_y;
+    m.captured_x = captured_x, m.captured_y = captured_y, m.captured_type = captured;
+    m.promotion_type = promotion;
+    move_stack.push_back(m);
     move_count++;
 }
 
@@ -202,12 +174,22 @@ void chessboard::unmake_move()
 
     hash ^= zobrist_table[1][8];
 
+    if (en_passant)
+        hash ^= en_passant_keys[en_passant & 7];
+
+    if (move.previous_en_passant)
+        hash ^= en_passant_keys[move.previous_en_passant & 7];
+
+    hash ^= castling_keys[castling ^ move.previous_castling];
+
+    castling = move.previous_castling;
+    en_passant = move.previous_en_passant;
+    halfmove_clock = move.previous_halfmove_clock;
+    checkers = move.previous_checkers;
+
     if (move.empty())
         return;
 
-    if (move.two_squares_flag_changed)
-        hash ^= zobrist_table[0][8];
-
     int org_ind = move.org_x + move.org_y * 8;
     int dest_ind = move.dest_x + move.dest_y * 8;
     int cap_ind = move.captured_x + move.captured_y * 8;
@@ -223,8 +205,8 @@ void chessboard::unmake_move()
     bits org_mask = 1ull << org_ind;
     bits dest_mask = 1ull << dest_ind;
 
-    int delta_x = move.org_x - move.dest_x, delta_y = move.org_y - move.dest_y;
-    int change_x = std::abs(delta_x), change_y = std::abs(delta_y);
+    int delta_x = move.org_x - move.dest_x;
+    int change_x = std::abs(delta_x);
 
     // This is castling, move the rook
     if (org_type == king && change_x == 2) {
@@ -238,7 +220,6 @@ void chessboard::unmake_move()
         hash ^= zobrist_table[rook_org][rk] ^ zobrist_table[rook_dst][rk];
     }
 
-    has_moved = has_moved & ~(org_mask | dest_mask) | (bits)move.org_had_moved << org_ind;
     side_sets[org_side] ^= dest_mask ^ org_mask;
     piece_sets[org_type] ^= dest_mask;
     pieces[dest_ind] = 0;
@@ -247,7 +228,6 @@ void chessboard::unmake_move()
     hash ^= zobrist_table[dest_ind][org_piece] ^ zobrist_table[org_ind][pieces[org_ind]];
 
     if (move.captured_type) {
-        has_moved = has_moved & ~cap_mask | (bits)move.captured_had_moved << cap_ind;
         pieces[cap_ind] = cap_piece;
         side_sets[cap_side] |= cap_mask;
         piece_sets[cap_type] |= cap_mask;
@@ -258,16 +238,8 @@ void chessboard::unmake_move()
 size_t chessboard::zobrist() {
     size_t h = 0;
 
-    int pawn_two_squares = 0;
-
-    if (move_stack.size()) {
-        const auto &last = move_stack.back();
-        pawn_two_squares =
-            (pieces[last.dest_x + last.dest_y * 8] & type_mask) == pawn
-            && std::abs(last.org_y - last.dest_y) == 2;
-    }
-
-    h ^= pawn_two_squares * zobrist_table[0][8];
+    h ^= castling_keys[castling];
+    h ^= en_passant ? en_passant_keys[en_passant & 7] : 0;
     h ^= side_to_move * zobrist_table[1][8];
 
     for (int i = 0; i < 64; i++)
@@ -280,30 +252,16 @@ size_t chessboard::zobrist() {
 bool chessboard::any_pseudo_captures(int side, size_t target) {
     unsigned long ind;
 
-    const chessmove &last_move = move_stack.size() ? move_stack.back() : chessmove{};
     bits all_pieces = side_sets[0] | side_sets[1];
-    bits last_move_dest = 1ull << last_move.dest_y * 8 + last_move.dest_x;
-
-    int fside = side * 2 - 1;
-    bits our = side_sets[side], theirs = side_sets[side ^ 1];
-    bits free = ~all_pieces;
-    bits not_friendly = free | theirs;
+    bits our = side_sets[side];
 
-    // Process pawns
+    // Process pawns, en passant only ever captures a pawn so the target square is all that matters
     bits pawns = piece_sets[pawn] & our;
 
     while (pawns) {
         _BitScanForward64(&ind, pawns);
 
-        bits bit = 1ull << ind;
-        bits capture_base = (0b101ull << (ind % 8) >> 1 & 255ull) << ((ind / 8 - fside) << 3);
-        if (capture_base & target)
-            return true;
-
-        bool last_moved_enemy_pawn = piece_sets[pawn] & last_move_dest;
-
-        if (int(last_move.org_y - last_move.dest_y == (fside * 2) && last_moved_enemy_pawn)
-            * ((side ? last_move_dest << 8 : last_move_dest >> 8) & capture_base & target))
+        if (pawn_capture_masks[side][ind] & target)
             return true;
 
         pawns &= pawns - 1;
@@ -333,8 +291,8 @@ bool chessboard::any_pseudo_captures(int side, size_t target) {
         while (sliding) {
             _BitScanForward64(&ind, sliding);
 
-            const sliding_mask **fw = masks_fw[ind];
-            const sliding_mask **rev = masks_rev[ind];
+            const sliding_mask *const *fw = masks_fw[ind];
+            const sliding_mask *const *rev = masks_rev[ind];
 
             for (int i = start; i < end; i++) {
                 long long maskfw = fw[i]->last & all_pieces;
@@ -351,13 +309,190 @@ bool chessboard::any_pseudo_captures(int side, size_t target) {
     return false;
 }
 
+bits sliding_attacks(int square, bits occupied, int start, int end) {
+    bits attacks = 0;
+    unsigned long b;
+
+    const sliding_mask *const *fw = masks_fw[square];
+    const sliding_mask *const *rev = masks_rev[square];
+
+    for (int i = start; i < end; i++) {
+        bits maskfw = fw[i]->last, maskrev = rev[i]->last;
+
+        if (_BitScanForward64(&b, fw[i]->last & occupied))
+            maskfw = fw[i]->steps[b];
+
+        if (_BitScanReverse64(&b, rev[i]->last & occupied))
+            maskrev = rev[i]->steps[b];
+
+        attacks |= maskfw | maskrev;
+    }
+
+    return attacks;
+}
+
+// Pieces of both sides attacking a square, with sliders seeing through anything not in 'occupied'
+bits chessboard::attackers_to(int square, bits occupied) const {
+    bits diagonal = piece_sets[bishop] | piece_sets[queen];
+    bits straight = piece_sets[rook] | piece_sets[queen];
+
+    return
+        (pawn_capture_masks[0][square] & piece_sets[pawn] & side_sets[1]) |
+        (pawn_capture_masks[1][square] & piece_sets[pawn] & side_sets[0]) |
+        (capture_masks[square][knight] & piece_sets[knight]) |
+        (capture_masks[square][king] & piece_sets[king]) |
+        (sliding_attacks(square, occupied, 0, 2) & diagonal) |
+        (sliding_attacks(square, occupied, 2, 4) & straight);
+}
+
+// Static exchange evaluation of the capture org_ind -> dest_ind,
+// assuming both sides keep recapturing with their least valuable attacker
+int chessboard::see(int org_ind, int dest_ind) const {
+    static const int values[pawn + 1] = { 0, 20000, 1025, 365, 337, 477, 82 };
+
+    int gain[32], d = 0;
+    int attacker = pieces[org_ind] & type_mask;
+    int side = pieces[org_ind] >> side_shift;
+    int victim = pieces[dest_ind] & type_mask;
+
+    // En passant
+    if (!victim && attacker == pawn && (org_ind & 7) != (dest_ind & 7))
+        victim = pawn;
+
+    bits occupied = side_sets[0] | side_sets[1];
+    bits from = 1ull << org_ind;
+
+    gain[0] = values[victim];
+
+    for (;;) {
+        d++;
+        side ^= 1;
+        gain[d] = values[attacker] - gain[d - 1];
+
+        if (std::max(-gain[d - 1], gain[d]) < 0 || d == 31)
+            break;
+
+        occupied ^= from;
+
+        bits attackers = attackers_to(dest_ind, occupied) & occupied & side_sets[side];
+
+        if (!attackers)
+            break;
+
+        // Pick the least valuable attacker
+        static const int cheapest_first[] = { pawn, knight, bishop, rook, queen, king };
+
+        for (int type : cheapest_first) {
+            if (bits set = attackers & piece_sets[type]) {
+                from = set & -(long long)set;
+                attacker = type;
+                break;
+            }
+        }
+    }
+
+    while (--d)
+        gain[d - 1] = -std::max(-gain[d - 1], gain[d]);
+
+    return gain[0];
+}
+
 bool chessboard::any_moves(int side) {
     bits b[64] = {0};
     return generate_moves(side, b, false, true);
 }
 
+bits chessboard::find_checkers() const {
+    unsigned long square;
+
+    if (!_BitScanForward64(&square, piece_sets[king] & side_sets[side_to_move]))
+        return 0;
+
+    return attackers_to(square, side_sets[0] | side_sets[1]) & side_sets[side_to_move ^ 1];
+}
+
+// The side to move has its checkers at hand, the other side's king is only
+// looked at from its own square
 bool chessboard::in_check(int side) {
-    return any_pseudo_captures(side ^ 1, piece_sets[king] & side_sets[side]);
+    if (side == side_to_move)
+        return checkers;
+
+    unsigned long square;
+
+    if (!_BitScanForward64(&square, piece_sets[king] & side_sets[side]))
+        return false;
+
+    return attackers_to(square, side_sets[0] | side_sets[1]) & side_sets[side ^ 1];
+}
+
+bool chessboard::is_move_safe(int for_side, int org_x, int org_y, int dest_x, int dest_y) const {
+    int org_ind = org_x + org_y * 8, dest_ind = dest_x + dest_y * 8;
+    bits from = 1ull << org_ind, to = 1ull << dest_ind;
+    unsigned long king_square;
+
+    if (!_BitScanForward64(&king_square, piece_sets[king] & side_sets[for_side]))
+        return true;
+
+    if (king_square == org_ind)
+        king_square = dest_ind;
+
+    // Whatever stands on the destination is captured
+    bits occupied = (side_sets[0] | side_sets[1]) & ~from | to;
+    bits theirs = side_sets[for_side ^ 1] & ~to;
+
+    // En passant takes a pawn off another square
+    if ((pieces[org_ind] & type_mask) == pawn && org_x != dest_x && !pieces[dest_ind]) {
+        bits captured = 1ull << (dest_ind + (for_side ? 8 : -8));
+        occupied &= ~captured;
+        theirs &= ~captured;
+    }
+
+    return !(attackers_to(king_square, occupied) & theirs);
+}
+
+bool chessboard::gives_check(int org_ind, int dest_ind) const {
+    int type = pieces[org_ind] & type_mask, side = pieces[org_ind] >> side_shift;
+    unsigned long king_square;
+
+    if (!_BitScanForward64(&king_square, piece_sets[king] & side_sets[side ^ 1]))
+        return false;
+
+    bits from = 1ull << org_ind, to = 1ull << dest_ind, target = 1ull << king_square;
+    bits occupied = (side_sets[0] | side_sets[1]) & ~from | to;
+    bits ours = side_sets[side] & ~from;
+    bits diagonal = (piece_sets[bishop] | piece_sets[queen]) & ours;
+    bits straight = (piece_sets[rook] | piece_sets[queen]) & ours;
+
+    if (type == pawn) {
+        // En passant also takes the captured pawn off the board
+        if ((org_ind & 7) != (dest_ind & 7) && !pieces[dest_ind])
+            occupied &= ~(1ull << (dest_ind + (side ? 8 : -8)));
+
+        if (dest_ind >> 3 == (1 - side) * 7)
+            type = queen;
+    }
+
+    // Castling moves the rook next to the king's destination
+    if (type == king && std::abs((org_ind & 7) - (dest_ind & 7)) == 2) {
+        int rook_org = (dest_ind & 7) < (org_ind & 7) ? org_ind - 4 : org_ind + 3;
+        int rook_dst = (org_ind + dest_ind) / 2;
+
+        occupied ^= 1ull << rook_org | 1ull << rook_dst;
+        straight ^= 1ull << rook_org | 1ull << rook_dst;
+    }
+
+    // Checks by the moved piece itself
+    switch (type) {
+    case pawn: if (pawn_capture_masks[side][dest_ind] & target) return true; break;
+    case knight: if (capture_masks[dest_ind][knight] & target) return true; break;
+    case bishop: diagonal |= to; break;
+    case rook: straight |= to; break;
+    case queen: diagonal |= to, straight |= to; break;
+    }
+
+    // And by the sliders the move uncovers
+    return sliding_attacks(king_square, occupied, 0, 2) & diagonal ||
+        sliding_attacks(king_square, occupied, 2, 4) & straight;
 }
 
 bits chessboard::legalize(int side, int i, bits moves)
@@ -378,17 +513,15 @@ bits chessboard::legalize(int side, int i, bits moves)
 bool chessboard::generate_moves(int side, bits *matrices, bool pseudo, bool exit_on_legal, bits mask) {
     unsigned long ind;
 
-    const chessmove &last_move = move_stack.size() ? move_stack.back() : chessmove{};
     bits all_pieces = side_sets[0] | side_sets[1];
-    bits last_move_dest = 1ull << last_move.dest_y * 8 + last_move.dest_x;
-
-    int fside = side * 2 - 1;
     bits our = side_sets[side], theirs = side_sets[side ^ 1];
     bits free = ~all_pieces;
     bits not_friendly = free | theirs;
+    bits en_passant_target = en_passant ? 1ull << en_passant : 0;
 
-    // Process pawns
+    // Process pawns, only those still on their starting rank can step twice
     bits pawns = piece_sets[pawn] & our;
+    bits start_rank = side ? 255ull << 48 : 255ull << 8;
 
     bits shifted_free = side ? free >> 8 : free << 8;
 
@@ -396,17 +529,12 @@ bool chessboard::generate_moves(int side, bits *matrices, bool pseudo, bool exit
         _BitScanForward64(&ind, pawns);
 
         bits bit = 1ull << ind;
-        bits capture_base = (0b101ull << (ind % 8) >> 1 & 255ull) << ((ind / 8 - fside) << 3);
-        bits capture_mask = capture_base & theirs;
+        bits capture_base = pawn_capture_masks[side][ind];
+        bits capture_mask = capture_base & (theirs | en_passant_target);
         bits step_mask = (side ? bit >> 8 : bit << 8) & free;
-        bits double_mask = (~has_moved >> ind & 1) * ((side ? bit >> 16 : bit << 16) & free & shifted_free);
-
-        bool last_moved_enemy_pawn = piece_sets[pawn] & last_move_dest;
-        bits en_passant_mask =
-            int(last_move.dest_y - last_move.org_y == (fside * 2) && last_moved_enemy_pawn)
-            * ((side ? last_move_dest << 8 : last_move_dest >> 8) & capture_base);
+        bits double_mask = (bit & start_rank ? (side ? bit >> 16 : bit << 16) : 0) & free & shifted_free;
 
-        matrices[ind] = capture_mask | step_mask | double_mask | en_passant_mask;
+        matrices[ind] = capture_mask | step_mask | double_mask;
 
         if (!pseudo && (matrices[ind] = legalize(side, ind, matrices[ind] & mask)) && exit_on_legal)
             return true;
@@ -433,32 +561,33 @@ bool chessboard::generate_moves(int side, bits *matrices, bool pseudo, bool exit
                     return (i & 7) == i && (j & 7) == j && all_pieces & (1ull << (i | j << 3));
                 };
 
-                auto can_castle = [this, piece, side, x, y, pseudo](int rx, int ry) -> bool {
-                    if (has_moved & 1ull << rx + ry * 8ll ||
-                        has_moved & 1ull << x + y * 8ll)
+                auto can_castle = [this, piece, side, x, y](int rx) -> bool {
+                    if (!(castling & (rx ? castle_kingside(side) : castle_queenside(side))))
                         return false;
 
-                    int dx = sgn(rx - x), X = -1;
+                    int dx = sgn(rx - x);
 
-                    for (int i = 1; between(X = x + i * dx, 2, 7); i++)
-                        if (piece(i * dx, 0) || (i != 1 && !is_move_safe(side, x, y, X, y)))
+                    // Everything between the king and the rook has to be empty
+                    for (int X = x + dx; X != rx; X += dx)
+                        if (piece(X - x, 0))
                             return false;
 
-                    return true;
+                    // The king can't pass through an attacked square, legalize checks where it lands
+                    return is_move_safe(side, x, y, x + dx, y);
                 };
 
                 if (!in_check(side)) {
                     bits relevant_rooks = our & piece_sets[rook];
                     bits left_rook = 1ull << 8 * y, right_rook = 1ull << 7 + 8 * y;
 
-                    if (relevant_rooks & left_rook && can_castle(0, y)) {
+                    if (relevant_rooks & left_rook && can_castle(0)) {
                         matrices[ind] |= 1ull << ind - 2;
 
                         if (!pseudo && (matrices[ind] = legalize(side, ind, matrices[ind] & mask)) && exit_on_legal)
                             return true;
                     }
 
-                    if (relevant_rooks & right_rook && can_castle(7, y)) {
+                    if (relevant_rooks & right_rook && can_castle(7)) {
                         matrices[ind] |= 1ull << ind + 2;
 
                         if (!pseudo && (matrices[ind] = legalize(side, ind, matrices[ind] & mask)) && exit_on_legal)
@@ -489,8 +618,8 @@ bool chessboard::generate_moves(int side, bits *matrices, bool pseudo, bool exit
 
             bits captures = 0;
 
-            const sliding_mask **fw = masks_fw[ind];
-            const sliding_mask **rev = masks_rev[ind];
+            const sliding_mask *const *fw = masks_fw[ind];
+            const sliding_mask *const *rev = masks_rev[ind];
 
             for (int i = start; i < end; i++) {
                 unsigned long b;
@@ -518,6 +647,65 @@ bool chessboard::generate_moves(int side, bits *matrices, bool pseudo, bool exit
     return false;
 }
 
+// Pseudo-legal captures and promotions only, for quiescence search
+bool chessboard::generate_captures(int side, bits *matrices) {
+    unsigned long ind;
+
+    bits all_pieces = side_sets[0] | side_sets[1];
+    bits our = side_sets[side], theirs = side_sets[side ^ 1];
+    bits free = ~all_pieces;
+    bits promotion_rank = side ? 255ull : 255ull << 56;
+    bits en_passant_target = en_passant ? 1ull << en_passant : 0;
+    bool any = false;
+
+    // Process pawns
+    bits pawns = piece_sets[pawn] & our;
+
+    while (pawns) {
+        _BitScanForward64(&ind, pawns);
+
+        bits bit = 1ull << ind;
+        bits capture_base = pawn_capture_masks[side][ind];
+        bits step_mask = (side ? bit >> 8 : bit << 8) & free & promotion_rank;
+
+        any |= (matrices[ind] = capture_base & (theirs | en_passant_target) | step_mask) != 0;
+
+        pawns &= pawns - 1;
+    }
+
+    // Process non-sliding pieces
+    int types[] = { knight, king };
+
+    for (int i = 0; i < 2; i++) {
+        bits set = piece_sets[types[i]] & our;
+
+        while (set) {
+            _BitScanForward64(&ind, set);
+            any |= (matrices[ind] = capture_masks[ind][types[i]] & theirs) != 0;
+            set &= set - 1;
+        }
+    }
+
+    // Process sliding pieces
+    int sliding_types[] = { bishop, rook, queen };
+
+    for (int i = 0; i < 3; i++) {
+        int type = sliding_types[i];
+        bits sliding = piece_sets[type] & our;
+
+        const int start = (type == rook) ? 2 : 0;
+        const int end = (type == bishop) ? 2 : 4;
+
+        while (sliding) {
+            _BitScanForward64(&ind, sliding);
+            any |= (matrices[ind] = sliding_attacks(ind, all_pieces, start, end) & theirs) != 0;
+            sliding &= sliding - 1;
+        }
+    }
+
+    return any;
+}
+
 void chessboard::print() {
     for (int i = 0; i < 64; i++) {
         std::printf("%x", pieces[i]);
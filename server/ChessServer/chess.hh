@@ -26,31 +26,63 @@ enum : int {
     type_mask = 0b0111, side_shift = 3
 };
 
-void init_lookups();
+// Zobrist keys come from this seed, hashes stored on disk are only valid with the same keys
+constexpr size_t zobrist_seed = 339532;
+
+// Digest of the generated Zobrist keys
+size_t zobrist_fingerprint();
+
+extern const int piece_values[pawn + 1];
+
+// Bishop directions are [0, 2), rook directions are [2, 4)
+bits sliding_attacks(int square, bits occupied, int start, int end);
+
+// Castling rights, one bit per side and wing
+inline constexpr int castle_kingside(int side) { return 1 << side * 2; }
+inline constexpr int castle_queenside(int side) { return 2 << side * 2; }
+constexpr int all_castling = 15;
 
 struct chessmove {
-    int org_x = 0, org_y = 0, org_had_moved = 0;
+    int org_x = 0, org_y = 0;
     int dest_x = 0, dest_y = 0;
-    int captured_x = 0, captured_y = 0, captured_type = 0, captured_had_moved = 0;
-    int promotion_type = 0, two_squares_flag_changed = 0;
+    int captured_x = 0, captured_y = 0, captured_type = 0;
+    int promotion_type = 0;
+
+    // State that make_move overwrites, for unmake_move
+    int previous_castling = 0, previous_en_passant = 0, previous_halfmove_clock = 0;
+    bits previous_checkers = 0;
 
     inline bool empty() const { return !org_x && !org_y && !dest_x && !dest_y; }
 };
 
-struct chessboard {
+// Everything make_move changes besides the move stack and the repetition counts,
+// small enough that saving a copy is as cheap as unmaking the move
+struct alignas(64) board_state {
+    std::array<char, 64> pieces{ 0 };
+    bits side_sets[2]{ 0 }, piece_sets[pawn + 1]{ 0 };
+    size_t hash = 0;
+    int move_count = 0, side_to_move = 1;
+    int castling = all_castling;
+
+    // Square passed by a double pawn step on the last move, 0 if there was none
+    int en_passant = 0;
+
+    // Moves since the last capture or pawn move
+    int halfmove_clock = 0;
+
+    // Pieces giving check to the side to move
+    bits checkers = 0;
+};
+
+struct chessboard : board_state {
 private:
     bits legalize(int side, int i, bits moves);
 public:
     int appended_moves = 0;
 
     //std::unordered_multiset<size_t> previous_states;
-    size_t hash = 0;
     fastmap<uint16_t> previous_states;
     std::vector<chessmove> move_stack;
-    std::array<char, 64> pieces{ 0 };
-    bits side_sets[2]{ 0 }, piece_sets[pawn + 1]{ 0 };
-    bits has_moved = 0;
-    int move_count = 0, side_to_move = 1;
 
     chessboard() { move_stack.reserve(64); }
 
@@ -72,22 +104,39 @@ public:
     void make_move(int org_x, int org_y, int dest_x, int dest_y);
     void unmake_move();
 
-    size_t zobrist();
-
-    inline bool is_move_safe(int for_side, int org_x, int org_y, int dest_x, int dest_y) {
-        make_move(org_x, org_y, dest_x, dest_y);
-        bool check = in_check(for_side);
-        unmake_move();
+    // Copy-make, takes back the last move by returning to the state saved before it
+    inline void restore(const board_state &saved) {
+        if (!move_stack.back().empty())
+            previous_states[hash]--;
 
-        return !check;
+        move_stack.pop_back();
+        static_cast<board_state &>(*this) = saved;
     }
 
+    // Drops the castling rights whose king or rook isn't on its original square
+    void validate_castling();
+
+    size_t zobrist();
+
+    // Whether the move leaves the own king unattacked, tested without making it
+    bool is_move_safe(int for_side, int org_x, int org_y, int dest_x, int dest_y) const;
+
     bool any_pseudo_captures(int side, bits target = ~0ull);
 
+    bits attackers_to(int square, bits occupied) const;
+
+    // Computes checkers from scratch, for positions that weren't reached by make_move
+    bits find_checkers() const;
+
+    // Whether the move puts the other side in check, without making it
+    bool gives_check(int org_ind, int dest_ind) const;
+    int see(int org_ind, int dest_ind) const;
+
     bool any_moves(int side);
 
     bool in_check(int side);
     bool generate_moves(int side, bits *matrices, bool pseudo = false, bool exit_on_legal = false, bits mask = ~0ull);
+    bool generate_captures(int side, bits *matrices);
 
     void print();
 
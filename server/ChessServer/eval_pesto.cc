@@ -1,17 +1,14 @@
 #include "eval.hh"
 
-const int mg_value[7] = {0, 0, 1025, 365, 337, 477, 82};
-const int eg_value[7] = {0, 0, 936, 297, 281, 936, 94};
+constexpr int mg_value[7] = {0, 0, 1025, 365, 337, 477, 82};
+constexpr int eg_value[7] = {0, 0, 936, 297, 281, 936, 94};
 
-const int gamephase_inc[16] = {
+constexpr int gamephase_inc[16] = {
     0, 0, 4, 1, 1, 2, 0, 0,
     0, 0, 4, 1, 1, 2, 0, 0
 };
 
-int mg_table[16][64];
-int eg_table[16][64];
-
-const int mg_pawn_table[64] = {
+constexpr int mg_pawn_table[64] = {
       0,   0,   0,   0,   0,   0,  0,   0,
      98, 134,  61,  95,  68, 126, 34, -11,
      -6,   7,  26,  31,  65,  56, 25, -20,
@@ -22,7 +19,7 @@ const int mg_pawn_table[64] = {
       0,   0,   0,   0,   0,   0,  0,   0,
 };
 
-const int eg_pawn_table[64] = {
+constexpr int eg_pawn_table[64] = {
       0,   0,   0,   0,   0,   0,   0,   0,
     178, 173, 158, 134, 147, 132, 165, 187,
      94, 100,  85,  67,  56,  53,  82,  84,
@@ -33,7 +30,7 @@ const int eg_pawn_table[64] = {
       0,   0,   0,   0,   0,   0,   0,   0,
 };
 
-const int mg_knight_table[64] = {
+constexpr int mg_knight_table[64] = {
     -167, -89, -34, -49,  61, -97, -15, -107,
      -73, -41,  72,  36,  23,  62,   7,  -17,
      -47,  60,  37,  65,  84, 129,  73,   44,
@@ -44,7 +41,7 @@ const int mg_knight_table[64] = {
     -105, -21, -58, -33, -17, -28, -19,  -23,
 };
 
-const int eg_knight_table[64] = {
+constexpr int eg_knight_table[64] = {
     -58, -38, -13, -28, -31, -27, -63, -99,
     -25,  -8, -25,  -2,  -9, -25, -24, -52,
     -24, -20,  10,   9,  -1,  -9, -19, -41,
@@ -55,7 +52,7 @@ const int eg_knight_table[64] = {
     -29, -51, -23, -15, -22, -18, -50, -64,
 };
 
-const int mg_bishop_table[64] = {
+constexpr int mg_bishop_table[64] = {
     -29,   4, -82, -37, -25, -42,   7,  -8,
     -26,  16, -18, -13,  30,  59,  18, -47,
     -16,  37,  43,  40,  35,  50,  37,  -2,
@@ -66,7 +63,7 @@ const int mg_bishop_table[64] = {
     -33,  -3, -14, -21, -13, -12, -39, -21,
 };
 
-const int eg_bishop_table[64] = {
+constexpr int eg_bishop_table[64] = {
     -14, -21, -11,  -8, -7,  -9, -17, -24,
      -8,  -4,   7, -12, -3, -13,  -4, -14,
       2,  -8,   0,  -1, -2,   6,   0,   4,
@@ -77,7 +74,7 @@ const int eg_bishop_table[64] = {
     -23,  -9, -23,  -5, -9, -16,  -5, -17,
 };
 
-const int mg_rook_table[64] = {
+constexpr int mg_rook_table[64] = {
      32,  42,  32,  51, 63,  9,  31,  43,
      27,  32,  58,  62, 80, 67,  26,  44,
      -5,  19,  26,  36, 17, 45,  61,  16,
@@ -88,7 +85,7 @@ const int mg_rook_table[64] = {
     -19, -13,   1,  17, 16,  7, -37, -26,
 };
 
-const int eg_rook_table[64] = {
+constexpr int eg_rook_table[64] = {
     13, 10, 18, 15, 12,  12,   8,   5,
     11, 13, 13, 11, -3,   3,   8,   3,
      7,  7,  7,  5,  4,  -3,  -5,  -3,
@@ -99,7 +96,7 @@ const int eg_rook_table[64] = {
     -9,  2,  3, -1, -5, -13,   4, -20,
 };
 
-const int mg_queen_table[64] = {
+constexpr int mg_queen_table[64] = {
     -28,   0,  29,  12,  59,  44,  43,  45,
     -24, -39,  -5,   1, -16,  57,  28,  54,
     -13, -17,   7,   8,  29,  56,  47,  57,
@@ -110,7 +107,7 @@ const int mg_queen_table[64] = {
      -1, -18,  -9,  10, -15, -25, -31, -50,
 };
 
-const int eg_queen_table[64] = {
+constexpr int eg_queen_table[64] = {
      -9,  22,  22,  27,  27,  19,  10,  20,
     -17,  20,  32,  41,  58,  25,  30,   0,
     -20,   6,   9,  49,  47,  35,  19,   9,
@@ -121,7 +118,7 @@ const int eg_queen_table[64] = {
     -33, -28, -22, -43,  -5, -32, -20, -41,
 };
 
-const int mg_king_table[64] = {
+constexpr int mg_king_table[64] = {
     -65,  23,  16, -15, -56, -34,   2,  13,
      29,  -1, -20,  -7,  -8,  -4, -38, -29,
      -9,  24,   2, -16, -20,   6,  22, -22,
@@ -132,7 +129,7 @@ const int mg_king_table[64] = {
     -15,  36,  12, -54,   8, -28,  24,  14,
 };
 
-const int eg_king_table[64] = {
+constexpr int eg_king_table[64] = {
     -74, -35, -18, -18, -11,  15,   4, -17,
     -12,  17,  14,  17,  17,  38,  23,  11,
      10,  17,  23,  15,  20,  45,  44,  13,
@@ -143,7 +140,7 @@ const int eg_king_table[64] = {
     -53, -34, -21, -11, -28, -14, -24, -43
 };
 
-const int *mg_pesto_table[6+1] =
+constexpr const int *mg_pesto_table[6+1] =
 {
     0,
     mg_king_table,
@@ -154,7 +151,7 @@ const int *mg_pesto_table[6+1] =
     mg_pawn_table,
 };
 
-const int *eg_pesto_table[6+1] =
+constexpr const int *eg_pesto_table[6+1] =
 {
     0,
     eg_king_table,
@@ -165,23 +162,31 @@ const int *eg_pesto_table[6+1] =
     eg_pawn_table,
 };
 
-bool initialized_tables = false;
+// Piece values plus square bonuses for every piece code, white squares are mirrored
+struct pesto_tables {
+    int mg[16][64], eg[16][64];
+};
 
-void initialize_tables()
+constexpr pesto_tables generate_tables()
 {
-    unsigned pc, p, sq;
-    for (p = king, pc = king | 1 << side_shift; p <= pawn; pc++, p++) {
-        for (sq = 0; sq < 64; sq++) {
-            mg_table[p][sq] = mg_value[p] + mg_pesto_table[p][sq ^ 0b111000];
-            eg_table[p][sq] = eg_value[p] + eg_pesto_table[p][sq ^ 0b111000];
-            mg_table[pc][sq] = mg_value[p] + mg_pesto_table[p][sq];
-            eg_table[pc][sq] = eg_value[p] + eg_pesto_table[p][sq];
+    pesto_tables t {};
+
+    for (unsigned p = king, pc = king | 1 << side_shift; p <= pawn; pc++, p++) {
+        for (unsigned sq = 0; sq < 64; sq++) {
+            t.mg[p][sq] = mg_value[p] + mg_pesto_table[p][sq ^ 0b111000];
+            t.eg[p][sq] = eg_value[p] + eg_pesto_table[p][sq ^ 0b111000];
+            t.mg[pc][sq] = mg_value[p] + mg_pesto_table[p][sq];
+            t.eg[pc][sq] = eg_value[p] + eg_pesto_table[p][sq];
         }
     }
 
-    initialized_tables = true;
+    return t;
 }
 
+constexpr pesto_tables pesto_values = generate_tables();
+constexpr auto &mg_table = pesto_values.mg;
+constexpr auto &eg_table = pesto_values.eg;
+
 extern std::atomic<int> g_total_nodes;
 
 int evaluation::game_phase_score(const chessboard &board)
@@ -197,9 +202,6 @@ int evaluation::game_phase_score(const chessboard &board)
 
 int evaluation::pesto(const chessboard &board, int side)
 {
-    if (!initialized_tables)
-        initialize_tables();
-
     int mg[2] {0, 0};
     int eg[2] {0, 0};
     int game_phase = 0;
@@ -1,15 +1,9 @@
 #include "eval.hh"
+#include "lookups.hh"
 
 constexpr bits file_A = 0x0101010101010101ULL;
 constexpr bits rank_1 = 0xFF00000000000000ULL;
 
-extern bits zobrist_table[64][16];
-extern bits capture_masks[64][6];
-extern sliding_mask bishop_masks[64][2][2];
-extern sliding_mask rook_masks[64][2][2];
-extern const sliding_mask *masks_fw[64][4];
-extern const sliding_mask *masks_rev[64][4];
-
 inline int pieces_on_file(const chessboard& board, int x, int type)
 {
     return file_A << x & board.piece_sets[type];
@@ -56,8 +50,8 @@ template<int side, int type> int eval_pieces(const chessboard& board)
         else if constexpr (type == bishop) {
             score += 360;
 
-            const sliding_mask **fw = masks_fw[ind];
-            const sliding_mask **rev = masks_rev[ind];
+            const sliding_mask *const *fw = masks_fw[ind];
+            const sliding_mask *const *rev = masks_rev[ind];
 
             for (int i = 0; i < 2; i++) {
                 unsigned long b;
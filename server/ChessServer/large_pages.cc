@@ -0,0 +1,148 @@
+#include "large_pages.hh"
+
+constexpr size_t huge_page_size = 2 << 20;
+
+inline size_t round_up(size_t bytes, size_t alignment) {
+    return (bytes + alignment - 1) / alignment * alignment;
+}
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+// Large pages need the "Lock pages in memory" right, which is granted
+// to the account by policy but still has to be enabled for the process
+bool enable_lock_memory_privilege() {
+    HANDLE token;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return false;
+
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    bool enabled =
+        LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+        GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle(token);
+    return enabled;
+}
+
+void *large_pages::allocate(size_t bytes, numa_policy policy, int node) {
+    static bool privileged = enable_lock_memory_privilege();
+    size_t large_page = GetLargePageMinimum();
+    void *memory = nullptr;
+
+    // Large pages are committed and placed right away, so binding has to happen here
+    if (privileged && large_page) {
+        DWORD type = MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES;
+        size_t size = round_up(bytes, large_page);
+
+        memory = policy == numa_policy::bind ?
+            VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, type, PAGE_READWRITE, DWORD(node)) :
+            VirtualAlloc(nullptr, size, type, PAGE_READWRITE);
+    }
+
+    // Interleaving has no direct equivalent, first touch from every search thread comes close
+    if (!memory)
+        memory = policy == numa_policy::bind ?
+            VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, DWORD(node)) :
+            VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    return memory;
+}
+
+void large_pages::release(void *memory, size_t) {
+    if (memory)
+        VirtualFree(memory, 0, MEM_RELEASE);
+}
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <charconv>
+#include <fstream>
+#include <string>
+
+constexpr int mpol_bind = 2, mpol_interleave = 3;
+
+// Nodes listed in /sys/devices/system/node/online, e.g. "0-1,3"
+unsigned long online_nodes() {
+    std::ifstream file("/sys/devices/system/node/online");
+    std::string list;
+    unsigned long mask = 0;
+
+    if (!std::getline(file, list))
+        return 1;
+
+    const char *p = list.data(), *end = p + list.size();
+
+    // Anything unexpected falls back to a single node
+    while (p < end) {
+        unsigned first, last;
+        auto parsed = std::from_chars(p, end, first);
+
+        if (parsed.ec != std::errc())
+            return 1;
+
+        p = parsed.ptr, last = first;
+
+        if (p < end && *p == '-') {
+            parsed = std::from_chars(p + 1, end, last);
+
+            if (parsed.ec != std::errc())
+                return 1;
+
+            p = parsed.ptr;
+        }
+
+        for (unsigned n = first; n <= last && n < 64; n++)
+            mask |= 1ul << n;
+
+        if (p < end && *p++ != ',')
+            return 1;
+    }
+
+    return mask ? mask : 1;
+}
+
+void *large_pages::allocate(size_t bytes, numa_policy policy, int node) {
+    size_t size = round_up(bytes, huge_page_size);
+
+    // Over-allocate so the table can start on a huge page boundary
+    void *mapping = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mapping == MAP_FAILED)
+        return nullptr;
+
+    char *start = (char *)mapping, *memory = (char *)round_up(size_t(start), huge_page_size);
+
+    if (memory > start)
+        munmap(start, memory - start);
+
+    if (memory + size < start + size + huge_page_size)
+        munmap(memory + size, start + size + huge_page_size - (memory + size));
+
+    madvise(memory, size, MADV_HUGEPAGE);
+
+#ifdef SYS_mbind
+    // Only a hint, without NUMA support the kernel rejects it and first touch applies
+    if (policy != numa_policy::first_touch) {
+        unsigned long nodes = policy == numa_policy::bind ? 1ul << node : online_nodes();
+        syscall(SYS_mbind, memory, size, policy == numa_policy::bind ? mpol_bind : mpol_interleave,
+            &nodes, sizeof nodes * 8, 0);
+    }
+#endif
+
+    return memory;
+}
+
+void large_pages::release(void *memory, size_t bytes) {
+    if (memory)
+        munmap(memory, round_up(bytes, huge_page_size));
+}
+#endif
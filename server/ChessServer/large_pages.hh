@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+
+// Where the pages of a large allocation are placed on multi-socket hosts
+enum class numa_policy {
+    // Next to the thread that touches a page first
+    first_touch,
+    // Round robin over all nodes, so no node serves every access
+    interleave,
+    // All on one node
+    bind
+};
+
+// Page aligned memory for big tables, backed by 2 MB pages where the system
+// allows it so that random accesses miss the TLB less often. The memory is
+// zeroed, and unless the system commits large pages up front each page is
+// only placed on a node when it's first written
+namespace large_pages
+{
+    void *allocate(size_t bytes, numa_policy policy = numa_policy::first_touch, int node = 0);
+    void release(void *memory, size_t bytes);
+}
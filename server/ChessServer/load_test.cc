@@ -0,0 +1,298 @@
+#include "chess.hh"
+#include "protocol.hh"
+#include <restbed>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+using namespace restbed;
+using namespace std::chrono;
+
+const std::string load_start_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+// The static files server.cc serves
+const char *file_paths[] = { "/", "/index.html", "/index.css", "/app.js", "/pieces.png" };
+constexpr int file_count = sizeof file_paths / sizeof *file_paths;
+
+struct load_settings {
+    std::string host = "localhost";
+    int port = 2023;
+    int users = 100, duration = 30, think = 0;
+    int depth = 64, movetime = 100, plies = 80;
+    double static_share = 0;
+    unsigned seed = 1;
+    std::string traces_path;
+};
+
+// A game as the client knows it: where it started and the moves since
+struct game_trace {
+    std::string fen;
+    std::vector<std::string> moves;
+};
+
+// What one simulated user saw, merged when the run is over
+struct user_results {
+    std::vector<double> move_latencies, file_latencies;
+    int move_errors = 0, file_errors = 0, failed_connections = 0;
+};
+
+// Trace lines are a FEN followed by the game's UCI moves, the format of batch positions
+std::vector<game_trace> load_traces(const std::string &path) {
+    std::vector<game_trace> traces;
+    std::ifstream file(path);
+    std::string line;
+    int invalid = 0;
+
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string field, move;
+        game_trace trace;
+
+        for (int i = 0; i < 6 && iss >> field; i++)
+            trace.fen += (i ? " " : "") + field;
+
+        while (iss >> move)
+            trace.moves.push_back(move);
+
+        chessboard board;
+        std::vector<size_t> history;
+
+        if (trace.fen.empty())
+            continue;
+
+        if (protocol::parse_position(line, board, history) != request_error::none) {
+            invalid++;
+            continue;
+        }
+
+        traces.push_back(std::move(trace));
+    }
+
+    if (invalid)
+        std::printf("Skipped %d invalid traces\n", invalid);
+
+    return traces;
+}
+
+// Sends one request and reads the whole response, the status is 0 if the server couldn't be reached
+int send(const load_settings &settings, const std::string &method, const char *path,
+    const std::string &body, std::string *reply = nullptr) {
+    auto request = std::make_shared<Request>(Uri("http://" + settings.host + ':' + std::to_string(settings.port) + path));
+
+    request->set_method(method);
+    request->set_header("Host", settings.host);
+
+    if (!body.empty()) {
+        request->set_header("Content-Length", std::to_string(body.size()));
+        request->set_body(body);
+    }
+
+    try {
+        auto response = Http::sync(request);
+        size_t length = response->get_header("Content-Length", 0);
+
+        if (length)
+            Http::fetch(length, response);
+
+        if (reply) {
+            const Bytes &data = response->get_body();
+            reply->assign(data.begin(), data.end());
+        }
+
+        return response->get_status_code();
+    }
+    catch (const std::exception &) {
+        return 0;
+    }
+}
+
+inline double milliseconds_since(steady_clock::time_point start) {
+    return duration_cast<duration<double, std::milli>>(steady_clock::now() - start).count();
+}
+
+// Requests the move for every position of the game in turn, like a client playing it.
+// Traces are replayed as recorded, without them the server's own moves are played from the start
+void run_user(int id, const load_settings &settings, const std::vector<game_trace> &traces,
+    steady_clock::time_point end, user_results &results) {
+    std::mt19937 random(settings.seed * 7919 + id);
+    std::uniform_real_distribution<double> share;
+
+    std::string limits =
+        "v2 " + std::to_string(settings.depth) + ' ' + std::to_string(std::max(settings.movetime / 1000, 1)) +
+        " movetime " + std::to_string(settings.movetime) + '\n';
+
+    game_trace game;
+    size_t ply = 0;
+
+    auto new_game = [&] {
+        game = traces.empty() ? game_trace{ load_start_fen, {} } : traces[random() % traces.size()];
+        ply = 0;
+    };
+
+    new_game();
+
+    while (steady_clock::now() < end) {
+        if (settings.think)
+            std::this_thread::sleep_for(milliseconds(settings.think));
+
+        auto start = steady_clock::now();
+
+        if (share(random) < settings.static_share) {
+            int status = send(settings, "GET", file_paths[random() % file_count], "");
+
+            results.file_latencies.push_back(milliseconds_since(start));
+            results.failed_connections += !status;
+            results.file_errors += status && status != OK && status != NOT_MODIFIED;
+            continue;
+        }
+
+        std::string moves;
+
+        for (size_t i = 0; i < ply; i++)
+            moves += (i ? " " : "") + game.moves[i];
+
+        std::string reply;
+        int status = send(settings, "POST", "/chess_engine", limits + game.fen + '\n' + moves, &reply);
+
+        results.move_latencies.push_back(milliseconds_since(start));
+        results.failed_connections += !status;
+        results.move_errors += status && status != OK;
+
+        if (status != OK) {
+            new_game();
+            continue;
+        }
+
+        if (traces.empty())
+            game.moves.push_back(reply.substr(0, reply.find(' ')));
+
+        bool over = ++ply > game.moves.size() || int(ply) >= settings.plies;
+
+        // Boards carry a large repetition table, only self-played games need one
+        if (!over && traces.empty()) {
+            chessboard board;
+            std::vector<size_t> history;
+            moves += (ply > 1 ? " " : "") + game.moves.back();
+            over = protocol::parse_position(game.fen + ' ' + moves, board, history) != request_error::none ||
+                !board.any_moves(board.side_to_move);
+        }
+
+        if (over)
+            new_game();
+    }
+}
+
+// Latency below which a share q of the requests finished
+double percentile(const std::vector<double> &sorted, double q) {
+    if (sorted.empty())
+        return 0;
+
+    size_t rank = size_t(std::ceil(q * sorted.size()));
+    return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+void print_latencies(const char *name, std::vector<double> &latencies, int errors) {
+    std::sort(latencies.begin(), latencies.end());
+
+    std::printf("%-6s %8zu requests %6d errors   p50 %8.1f ms   p99 %8.1f ms   p999 %8.1f ms\n",
+        name, latencies.size(), errors,
+        percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999));
+}
+
+void print_usage() {
+    std::printf(
+        "usage: load-test [options]\n"
+        "  -host       server address, localhost by default\n"
+        "  -port       server port, 2023 by default\n"
+        "  -users      concurrent games, each waits for its reply before the next request\n"
+        "  -duration   length of the run in seconds\n"
+        "  -think      pause of every user between requests in milliseconds\n"
+        "  -traces     file of \"<FEN> <UCI move> ...\" games to replay, the server\n"
+        "              plays against itself from the start position without one\n"
+        "  -plies      longest game before a user starts a new one\n"
+        "  -depth      depth limit of the move requests\n"
+        "  -movetime   time limit of the move requests in milliseconds\n"
+        "  -static     share of requests that fetch a static file instead, 0 to 1\n"
+        "  -seed       seed for picking traces and files\n");
+}
+
+int main(const int argc, const char **argv)
+{
+    load_settings settings;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i], value = argv[i + 1];
+
+        if (option == "-host") settings.host = value;
+        else if (option == "-port") settings.port = std::atoi(value.c_str());
+        else if (option == "-users") settings.users = std::max(std::atoi(value.c_str()), 1);
+        else if (option == "-duration") settings.duration = std::max(std::atoi(value.c_str()), 1);
+        else if (option == "-think") settings.think = std::max(std::atoi(value.c_str()), 0);
+        else if (option == "-traces") settings.traces_path = value;
+        else if (option == "-plies") settings.plies = std::max(std::atoi(value.c_str()), 1);
+        else if (option == "-depth") settings.depth = std::atoi(value.c_str());
+        else if (option == "-movetime") settings.movetime = std::atoi(value.c_str());
+        else if (option == "-static") settings.static_share = std::atof(value.c_str());
+        else if (option == "-seed") settings.seed = unsigned(std::atoi(value.c_str()));
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (argc % 2 == 0) {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<game_trace> traces;
+
+    if (!settings.traces_path.empty() && (traces = load_traces(settings.traces_path)).empty()) {
+        std::printf("No traces loaded from %s\n", settings.traces_path.c_str());
+        return 1;
+    }
+
+    std::printf("%d users for %d s against %s:%d\n", settings.users, settings.duration,
+        settings.host.c_str(), settings.port);
+
+    std::vector<user_results> results(settings.users);
+    std::vector<std::thread> users;
+
+    auto start = steady_clock::now();
+    auto end = start + seconds(settings.duration);
+
+    for (int i = 0; i < settings.users; i++)
+        users.emplace_back(run_user, i, std::cref(settings), std::cref(traces), end, std::ref(results[i]));
+
+    for (auto &user : users)
+        user.join();
+
+    double elapsed = milliseconds_since(start) / 1000;
+    user_results total;
+
+    for (user_results &r : results) {
+        total.move_latencies.insert(total.move_latencies.end(), r.move_latencies.begin(), r.move_latencies.end());
+        total.file_latencies.insert(total.file_latencies.end(), r.file_latencies.begin(), r.file_latencies.end());
+        total.move_errors += r.move_errors;
+        total.file_errors += r.file_errors;
+        total.failed_connections += r.failed_connections;
+    }
+
+    size_t requests = total.move_latencies.size() + total.file_latencies.size();
+
+    std::printf("%zu requests in %.1f s, %.1f per second, %d failed to connect\n",
+        requests, elapsed, requests / elapsed, total.failed_connections);
+
+    print_latencies("moves", total.move_latencies, total.move_errors);
+
+    if (!total.file_latencies.empty())
+        print_latencies("files", total.file_latencies, total.file_errors);
+
+    return 0;
+}
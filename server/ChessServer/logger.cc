@@ -0,0 +1,226 @@
+#include "logger.hh"
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+
+using namespace std::chrono;
+
+constexpr size_t log_slot_size = 1024;
+constexpr size_t log_slot_count = 4096;
+
+// Bounded multi-producer queue, every slot carries a sequence number telling
+// whether it's free for the writer of a given position or ready for the reader
+struct log_slot {
+    std::atomic<size_t> sequence;
+    size_t length;
+    char text[log_slot_size];
+};
+
+std::unique_ptr<log_slot[]> log_slots;
+std::atomic<size_t> log_write_pos = 0;
+size_t log_read_pos = 0;
+
+std::atomic<bool> log_running = false;
+std::atomic<size_t> log_dropped = 0;
+std::thread log_flusher;
+FILE *log_output = stdout;
+log_level log_threshold = log_level::info;
+
+const char *level_names[] = { "debug", "info", "warning", "error" };
+
+// Longest line write() produces before closing it, leaves room for the marker
+// of a cut line and the closing brace so a line always fits in one slot
+constexpr size_t log_line_limit = log_slot_size - sizeof(",\"truncated\":true}\n");
+
+// Returns false when the string had to be cut to keep the line within `limit`
+bool append_json_string(std::string &line, const std::string &value, size_t limit = SIZE_MAX) {
+    line += '"';
+
+    for (char c : value) {
+        size_t before = line.size();
+
+        switch (c) {
+        case '"': line += "\\\""; break;
+        case '\\': line += "\\\\"; break;
+        case '\n': line += "\\n"; break;
+        case '\r': line += "\\r"; break;
+        case '\t': line += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof escaped, "\\u%04x", c);
+                line += escaped;
+            }
+            else
+                line += c;
+        }
+
+        // One byte is kept for the closing quote
+        if (line.size() + 1 > limit) {
+            line.resize(before);
+
+            // Don't leave half of a UTF-8 sequence behind
+            while ((unsigned char)line.back() >= 0x80) {
+                bool lead = (unsigned char)line.back() >= 0xc0;
+                line.pop_back();
+
+                if (lead)
+                    break;
+            }
+
+            line += '"';
+            return false;
+        }
+    }
+
+    line += '"';
+    return true;
+}
+
+bool push_line(const std::string &line) {
+    size_t pos = log_write_pos.load(std::memory_order_relaxed);
+
+    for (;;) {
+        log_slot &slot = log_slots[pos % log_slot_count];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+        if (sequence == pos) {
+            if (log_write_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                // write() keeps lines within log_line_limit, so they always fit
+                slot.length = std::min(line.size(), log_slot_size);
+                std::memcpy(slot.text, line.data(), slot.length);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (sequence < pos)
+            return false;
+        else
+            pos = log_write_pos.load(std::memory_order_relaxed);
+    }
+}
+
+// Writes out everything published so far, returns whether there was anything
+bool drain() {
+    bool any = false;
+
+    for (;;) {
+        log_slot &slot = log_slots[log_read_pos % log_slot_count];
+
+        if (slot.sequence.load(std::memory_order_acquire) != log_read_pos + 1)
+            break;
+
+        std::fwrite(slot.text, 1, slot.length, log_output);
+        slot.sequence.store(log_read_pos + log_slot_count, std::memory_order_release);
+        log_read_pos++;
+        any = true;
+    }
+
+    if (size_t dropped = log_dropped.exchange(0)) {
+        long long time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+        std::fprintf(log_output, "{\"time\":%lld,\"level\":\"warning\",\"event\":\"log_dropped\",\"lines\":%zu}\n",
+            time, dropped);
+        any = true;
+    }
+
+    if (any)
+        std::fflush(log_output);
+
+    return any;
+}
+
+void logger::start(FILE *out, log_level threshold) {
+    if (log_running)
+        return;
+
+    log_slots = std::make_unique<log_slot[]>(log_slot_count);
+
+    for (size_t i = 0; i < log_slot_count; i++)
+        log_slots[i].sequence = i;
+
+    log_write_pos = 0;
+    log_read_pos = 0;
+    log_output = out;
+    log_threshold = threshold;
+    log_running = true;
+
+    log_flusher = std::thread([] {
+        while (log_running)
+            if (!drain())
+                std::this_thread::sleep_for(milliseconds(5));
+
+        drain();
+    });
+}
+
+void logger::stop() {
+    if (!log_running)
+        return;
+
+    log_running = false;
+    log_flusher.join();
+}
+
+void logger::write(log_level level, const char *event, std::initializer_list<log_field> fields) {
+    if (level < log_threshold)
+        return;
+
+    // Reused between calls so formatting doesn't allocate once it's warmed up
+    thread_local std::string line;
+
+    long long time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+
+    line.clear();
+    line += "{\"time\":";
+    line += std::to_string(time);
+    line += ",\"level\":\"";
+    line += level_names[int(level)];
+    line += "\",\"event\":";
+    append_json_string(line, event, log_line_limit);
+
+    // Past the limit string values are cut short and fields that don't fit are left out
+    bool truncated = false;
+
+    for (const log_field &field : fields) {
+        size_t mark = line.size();
+
+        line += ",\"";
+        line += field.key;
+        line += "\":";
+
+        if (field.quoted)
+            truncated = !append_json_string(line, field.value, log_line_limit);
+        else
+            line += field.value;
+
+        if (line.size() > log_line_limit) {
+            line.resize(mark);
+            truncated = true;
+        }
+
+        if (truncated)
+            break;
+    }
+
+    if (truncated)
+        line += ",\"truncated\":true";
+
+    line += "}\n";
+
+    // Before start and after stop there's no flusher to hand the line to
+    if (!log_running) {
+        std::fwrite(line.data(), 1, line.size(), log_output);
+        return;
+    }
+
+    if (!push_line(line))
+        log_dropped++;
+}
+
+bool logger::sample(int every) {
+    static std::atomic<unsigned> calls = 0;
+    return every <= 1 || calls++ % every == 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <cstdio>
+#include <initializer_list>
+
+enum class log_level { debug, info, warning, error };
+
+struct log_field {
+    const char *key;
+    std::string value;
+    bool quoted;
+
+    inline log_field(const char *k, const std::string &v) : key(k), value(v), quoted(true) {}
+    inline log_field(const char *k, const char *v) : key(k), value(v), quoted(true) {}
+    inline log_field(const char *k, int v) : key(k), value(std::to_string(v)), quoted(false) {}
+    inline log_field(const char *k, long long v) : key(k), value(std::to_string(v)), quoted(false) {}
+    inline log_field(const char *k, size_t v) : key(k), value(std::to_string(v)), quoted(false) {}
+    inline log_field(const char *k, double v) : key(k), value(std::to_string(v)), quoted(false) {}
+};
+
+// JSON lines written by a background thread. Writers format into a lock-free
+// ring buffer and never wait on the output, lines are dropped when it's full
+namespace logger
+{
+    void start(FILE *out, log_level threshold = log_level::info);
+    void stop();
+
+    void write(log_level level, const char *event, std::initializer_list<log_field> fields = {});
+
+    // True once every `every` calls, for output too frequent to keep all of
+    bool sample(int every);
+}
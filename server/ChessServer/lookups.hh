@@ -0,0 +1,160 @@
+#pragma once
+#include "chess.hh"
+
+// Attack masks and Zobrist keys, generated while compiling so that they
+// live in read-only data and need no initialization at startup
+
+// std::mt19937_64 as a constant expression, so the keys are the same as those
+// of earlier builds and of files written by them
+class zobrist_generator {
+    static constexpr int state_size = 312, shift_size = 156;
+
+    bits state[state_size] = {};
+    int index = state_size;
+
+    constexpr void twist() {
+        for (int i = 0; i < state_size; i++) {
+            bits y = (state[i] & 0xffffffff80000000ull) | (state[(i + 1) % state_size] & 0x7fffffffull);
+            state[i] = state[(i + shift_size) % state_size] ^ y >> 1 ^ (y & 1 ? 0xb5026f5aa96619e9ull : 0);
+        }
+
+        index = 0;
+    }
+public:
+    constexpr explicit zobrist_generator(bits seed) {
+        state[0] = seed;
+
+        for (int i = 1; i < state_size; i++)
+            state[i] = 6364136223846793005ull * (state[i - 1] ^ state[i - 1] >> 62) + i;
+    }
+
+    constexpr bits operator()() {
+        if (index == state_size)
+            twist();
+
+        bits y = state[index++];
+        y ^= y >> 29 & 0x5555555555555555ull;
+        y ^= y << 17 & 0x71d67fffeda60000ull;
+        y ^= y << 37 & 0xfff7eee000000000ull;
+        return y ^ y >> 43;
+    }
+};
+
+struct lookup_tables {
+    bits zobrist_table[64][16];
+    bits castling_keys[all_castling + 1];
+    bits en_passant_keys[8];
+    bits capture_masks[64][6];
+    bits pawn_capture_masks[2][64];
+    sliding_mask bishop_masks[64][2][2];
+    sliding_mask rook_masks[64][2][2];
+};
+
+constexpr lookup_tables generate_lookups() {
+    lookup_tables t {};
+    zobrist_generator e(zobrist_seed);
+
+    for (int i = 0; i < 64; i++)
+        for (int j = 0; j < 16; j++)
+            t.zobrist_table[i][j] = e();
+
+    // Taken from slots no piece uses, one key per castling right and en passant file
+    for (int rights = 0; rights <= all_castling; rights++)
+        for (int i = 0; i < 4; i++)
+            if (rights >> i & 1)
+                t.castling_keys[rights] ^= t.zobrist_table[i][15];
+
+    for (int x = 0; x < 8; x++)
+        t.en_passant_keys[x] = t.zobrist_table[x][7];
+
+    int I = 0;
+
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++, I++) {
+            auto a = [x, y](int i, int j) {
+                i += x, j += y;
+                if ((i & 7) == i && (j & 7) == j)
+                    return 1ull << i + j * 8;
+                return 0ull;
+            };
+
+            for (int i = -2; i <= 2; i += 4)
+                for (int j = -1; j <= 1; j += 2) {
+                    t.capture_masks[I][knight] |= a(i, j);
+                    t.capture_masks[I][knight] |= a(j, i);
+                }
+
+            for (int i = 0; i <= 1; i++) {
+                for (int j = 0; j <= 1; j++) {
+                    int X = 0, Y = 0;
+                    bits M = 0;
+                    do {
+                        if (j) Y += i * 2 - 1;
+                        else X += i * 2 - 1;
+                        bits value = t.rook_masks[I][i][j].last |= M = a(X, Y);
+                        if (M) t.rook_masks[I][i][j].steps[(x + X) + (y + Y) * 8] = value;
+                    } while (M);
+                }
+            }
+
+            for (int i = 0; i <= 1; i++) {
+                for (int j = 0; j <= 1; j++) {
+                    int X = 0, Y = 0;
+                    bits M = 0;
+                    do {
+                        X += i * 2 - 1;
+                        Y += j * 2 - 1;
+                        bits value = t.bishop_masks[I][i][j].last |= M = a(X, Y);
+                        if (M) t.bishop_masks[I][i][j].steps[(x + X) + (y + Y) * 8] = value;
+                    } while (M);
+                }
+            }
+
+            for (int j = -1; j <= 1; j += 2) {
+                for (int i = -1; i <= 1; i++)
+                    t.capture_masks[I][king] |= a(i, j);
+                t.capture_masks[I][king] |= a(j, 0);
+            }
+
+            // Side 1 pawns advance towards y = 0, side 0 pawns towards y = 7
+            for (int side = 0; side <= 1; side++)
+                t.pawn_capture_masks[side][I] = a(-1, 1 - side * 2) | a(1, 1 - side * 2);
+        }
+    }
+
+    return t;
+}
+
+inline constexpr lookup_tables lookups = generate_lookups();
+
+inline constexpr auto &zobrist_table = lookups.zobrist_table;
+inline constexpr auto &castling_keys = lookups.castling_keys;
+inline constexpr auto &en_passant_keys = lookups.en_passant_keys;
+inline constexpr auto &capture_masks = lookups.capture_masks;
+inline constexpr auto &pawn_capture_masks = lookups.pawn_capture_masks;
+inline constexpr auto &bishop_masks = lookups.bishop_masks;
+inline constexpr auto &rook_masks = lookups.rook_masks;
+
+// The ray of every direction from every square, forward rays run towards higher
+// square indices. Bishop directions are [0, 2), rook directions are [2, 4)
+struct sliding_directions {
+    const sliding_mask *rays[64][4];
+
+    constexpr const sliding_mask *const *operator[](int square) const { return rays[square]; }
+};
+
+constexpr sliding_directions generate_directions(bool forward) {
+    sliding_directions d {};
+
+    for (int i = 0; i < 64; i++) {
+        d.rays[i][0] = &lookups.bishop_masks[i][0][forward];
+        d.rays[i][1] = &lookups.bishop_masks[i][1][forward];
+        d.rays[i][2] = &lookups.rook_masks[i][forward][0];
+        d.rays[i][3] = &lookups.rook_masks[i][forward][1];
+    }
+
+    return d;
+}
+
+inline constexpr sliding_directions masks_fw = generate_directions(true);
+inline constexpr sliding_directions masks_rev = generate_directions(false);
@@ -0,0 +1,174 @@
+#include "mapped_file.hh"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+bool mapped_file::open(const std::string &path) {
+    close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+
+    if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+
+    view = (unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+    length = size_t(file_size.QuadPart);
+    return true;
+}
+
+bool mapped_file::open_writable(const std::string &path, size_t size) {
+    close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER new_size;
+    new_size.QuadPart = LONGLONG(size);
+
+    // A longer file from an earlier run is cut, the mapping extends a shorter one
+    if (!SetFilePointerEx(file, new_size, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+        DWORD(new_size.HighPart), new_size.LowPart, nullptr);
+
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+
+    view = (unsigned char *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+    length = size;
+    return true;
+}
+
+bool mapped_file::flush() {
+    return view && FlushViewOfFile(view, 0) && FlushFileBuffers(file_handle);
+}
+
+void mapped_file::close() {
+    if (view) UnmapViewOfFile(view);
+    if (mapping_handle) CloseHandle(mapping_handle);
+    if (file_handle) CloseHandle(file_handle);
+
+    view = nullptr;
+    mapping_handle = file_handle = nullptr;
+    length = 0;
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+bool mapped_file::open(const std::string &path) {
+    close();
+
+    int file = ::open(path.c_str(), O_RDONLY);
+
+    if (file < 0)
+        return false;
+
+    struct stat st;
+
+    if (fstat(file, &st) || !st.st_size) {
+        ::close(file);
+        return false;
+    }
+
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+
+    if (p == MAP_FAILED) {
+        ::close(file);
+        return false;
+    }
+
+    madvise(p, st.st_size, MADV_RANDOM);
+
+    fd = file;
+    view = (unsigned char *)p;
+    length = size_t(st.st_size);
+    return true;
+}
+
+bool mapped_file::open_writable(const std::string &path, size_t size) {
+    close();
+
+    int file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (file < 0)
+        return false;
+
+    if (ftruncate(file, off_t(size))) {
+        ::close(file);
+        return false;
+    }
+
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+
+    if (p == MAP_FAILED) {
+        ::close(file);
+        return false;
+    }
+
+    madvise(p, size, MADV_RANDOM);
+
+    fd = file;
+    view = (unsigned char *)p;
+    length = size;
+    return true;
+}
+
+bool mapped_file::flush() {
+    return view && !msync(view, length, MS_SYNC);
+}
+
+void mapped_file::close() {
+    if (view) munmap(view, length);
+    if (fd >= 0) ::close(fd);
+
+    view = nullptr;
+    fd = -1;
+    length = 0;
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+// Memory mapping of a whole file, either read-only or shared and writable
+class mapped_file {
+    unsigned char *view = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void *file_handle = nullptr, *mapping_handle = nullptr;
+#else
+    int fd = -1;
+#endif
+public:
+    mapped_file() {}
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file() { close(); }
+
+    bool open(const std::string &path);
+
+    // Creates the file if needed and sizes it to exactly size bytes,
+    // writes through the mapping end up in the file
+    bool open_writable(const std::string &path, size_t size);
+
+    // Writes modified pages back to the file without unmapping it
+    bool flush();
+    void close();
+
+    inline bool is_open() const { return view != nullptr; }
+    inline const unsigned char *data() const { return view; }
+    inline unsigned char *data() { return view; }
+    inline size_t size() const { return length; }
+};
@@ -0,0 +1,370 @@
+#include "chess.hh"
+#include "search.hh"
+#include "bitbase.hh"
+#include "protocol.hh"
+#include "task_scheduler.hh"
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+
+using namespace std::chrono;
+
+const std::string match_start_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+// Games that run this long are scored as draws
+constexpr int max_game_plies = 400;
+constexpr int default_moves_to_go = 30;
+
+struct engine_config {
+    std::string name;
+    eval_func eval = evaluation::pesto;
+    int threads = 1;
+    size_t hash = 64;
+    search_features features;
+};
+
+struct match_settings {
+    int base_time = 10000, increment = 100, movetime = 0, depth = 64;
+    int games = 20000, concurrency = 0;
+    unsigned seed = 1;
+    double elo0 = 0, elo1 = 5, alpha = 0.05, beta = 0.05;
+    std::string openings_path;
+};
+
+struct match_results {
+    int wins = 0, losses = 0, draws = 0;
+
+    inline int games() const { return wins + losses + draws; }
+    inline double score() const { return (wins + draws / 2.0) / games(); }
+
+    // Per game variance of the score
+    double variance() const {
+        double s = score();
+        return (wins * (1 - s) * (1 - s) + draws * (0.5 - s) * (0.5 - s) + losses * s * s) / games();
+    }
+};
+
+inline double score_to_elo(double score) {
+    score = std::min(std::max(score, 1e-6), 1 - 1e-6);
+    return -400 * std::log10(1 / score - 1);
+}
+
+inline double elo_to_score(double elo) {
+    return 1 / (1 + std::pow(10, -elo / 400));
+}
+
+// Log-likelihood ratio of elo1 against elo0, normal approximation of the trinomial model
+double sprt_llr(const match_results &r, double elo0, double elo1) {
+    if (!r.games() || r.variance() == 0)
+        return 0;
+
+    double s0 = elo_to_score(elo0), s1 = elo_to_score(elo1);
+    return (s1 - s0) * (2 * r.score() - s0 - s1) * r.games() / (2 * r.variance());
+}
+
+// Parses "eval=pesto,threads=4,hash=256,nmp=0" style configurations
+bool parse_config(const std::string &text, engine_config &config) {
+    std::istringstream iss(text);
+    std::string item;
+
+    config.name = text;
+
+    while (std::getline(iss, item, ',')) {
+        size_t eq = item.find('=');
+
+        if (eq == std::string::npos)
+            return false;
+
+        std::string key = item.substr(0, eq), value = item.substr(eq + 1);
+        bool on = value != "0";
+
+        if (key == "eval") {
+            if (value == "simplified") config.eval = evaluation::simplified;
+            else if (value == "proper") config.eval = evaluation::proper;
+            else if (value == "pesto") config.eval = evaluation::pesto;
+            else return false;
+        }
+        else if (key == "threads") config.threads = std::max(std::atoi(value.c_str()), 1);
+        else if (key == "hash") config.hash = std::max(std::atoi(value.c_str()), 1);
+        else if (key == "nmp") config.features.null_move = on;
+        else if (key == "lmr") config.features.late_move_reductions = on;
+        else if (key == "delta") config.features.delta_pruning = on;
+        else if (key == "see") config.features.see_pruning = on;
+        else if (key == "tb") config.features.tablebases = on;
+        else if (key == "se") config.features.singular_extensions = on;
+        else if (key == "iir") config.features.internal_reductions = on;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+// EPD lines carry the four position fields of a FEN followed by opcodes
+std::vector<std::string> load_openings(const std::string &path) {
+    std::vector<std::string> openings;
+    std::ifstream file(path);
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string fields[4];
+
+        if (iss >> fields[0] >> fields[1] >> fields[2] >> fields[3])
+            openings.push_back(fields[0] + ' ' + fields[1] + ' ' + fields[2] + ' ' + fields[3] + " 0 1");
+    }
+
+    return openings;
+}
+
+// Searches the position with one engine, stopping it when its time is up
+rated_move think(engine::instance &engine, const engine_config &config, chessboard &board,
+    int budget, int depth, int &elapsed) {
+    rated_move result;
+    search_limits limits;
+    limits.depth = depth;
+    limits.movetime = budget;
+
+    auto start = steady_clock::now();
+    engine::iterative_deepening_negamax(engine, board, result, limits, config.eval);
+    elapsed = int(duration_cast<milliseconds>(steady_clock::now() - start).count());
+
+    return result;
+}
+
+bool insufficient_material(const chessboard &board) {
+    bits heavy = board.piece_sets[pawn] | board.piece_sets[rook] | board.piece_sets[queen];
+    bits all = board.side_sets[0] | board.side_sets[1];
+
+    return !heavy && __popcnt64(all) <= 3;
+}
+
+// Plays one game and returns the result from white's point of view: 2 win, 1 draw, 0 loss
+int play_game(const engine_config &white, const engine_config &black, const std::string &opening,
+    const match_settings &settings, const char *&reason) {
+    // Engines of their own, so that games can run side by side
+    auto white_engine = engine::make_instance(white.hash, white.threads, white.features);
+    auto black_engine = engine::make_instance(black.hash, black.threads, black.features);
+
+    chessboard board;
+    std::vector<size_t> history;
+
+    if (protocol::parse_position(opening, board, history) != request_error::none) {
+        reason = "invalid opening";
+        return 1;
+    }
+
+    int clocks[2] = { settings.base_time, settings.base_time };
+
+    for (int ply = 0; ; ply++) {
+        int side = board.side_to_move;
+
+        if (!board.any_moves(side)) {
+            reason = board.in_check(side) ? "checkmate" : "stalemate";
+            return board.in_check(side) ? (side ? 0 : 2) : 1;
+        }
+
+        if (std::count(history.begin(), history.end(), board.hash) >= 3) {
+            reason = "threefold repetition";
+            return 1;
+        }
+
+        if (history.size() > 100) {
+            reason = "fifty move rule";
+            return 1;
+        }
+
+        if (insufficient_material(board)) {
+            reason = "insufficient material";
+            return 1;
+        }
+
+        if (ply >= max_game_plies) {
+            reason = "move limit";
+            return 1;
+        }
+
+        int budget = settings.movetime ? settings.movetime :
+            std::max(clocks[side] / default_moves_to_go + settings.increment * 3 / 4, 1);
+        int elapsed;
+
+        rated_move result = side ?
+            think(*white_engine, white, board, budget, settings.depth, elapsed) :
+            think(*black_engine, black, board, budget, settings.depth, elapsed);
+
+        if (!settings.movetime && (clocks[side] -= elapsed) < 0) {
+            reason = "loss on time";
+            return side ? 0 : 2;
+        }
+
+        clocks[side] += settings.increment;
+
+        const chessmove &m = result.move;
+        bits legal_moves[64] = { 0 };
+
+        board.generate_moves(side, legal_moves);
+
+        if (~legal_moves[m.org_x + m.org_y * 8] >> (m.dest_x + m.dest_y * 8) & 1) {
+            reason = "illegal move";
+            return side ? 0 : 2;
+        }
+
+        bool irreversible =
+            board.piecetype(m.dest_x, m.dest_y) ||
+            (board.piecetype(m.org_x, m.org_y) & type_mask) == pawn;
+
+        board.make_move(m.org_x, m.org_y, m.dest_x, m.dest_y);
+
+        if (irreversible)
+            history.clear();
+
+        history.push_back(board.hash);
+    }
+}
+
+void print_usage() {
+    std::printf(
+        "usage: match -a <config> -b <config> [options]\n"
+        "  config      comma separated eval=simplified|proper|pesto, threads=N, hash=MB,\n"
+        "              nmp=0|1, lmr=0|1, delta=0|1, see=0|1, tb=0|1,\n"
+        "              se=0|1, iir=0|1\n"
+        "  -openings   EPD file, each opening is played with both colors\n"
+        "  -tc         base+increment in seconds, e.g. 10+0.1\n"
+        "  -movetime   fixed time per move in milliseconds instead of a clock\n"
+        "  -depth      maximum search depth\n"
+        "  -games      maximum number of games\n"
+        "  -concurrency games played at once, by default as many as the cores fit\n"
+        "  -sprt       elo0,elo1 bounds of the test, 0,5 by default\n"
+        "  -seed       seed for shuffling the openings\n");
+}
+
+int main(const int argc, const char **argv)
+{
+    engine_config configs[2];
+    match_settings settings;
+    bool configured[2] = { false, false };
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i], value = argv[i + 1];
+
+        if (option == "-a" || option == "-b") {
+            int id = option == "-b";
+
+            if (!parse_config(value, configs[id])) {
+                std::printf("Invalid engine configuration %s\n", value.c_str());
+                return 1;
+            }
+
+            configured[id] = true;
+        }
+        else if (option == "-openings") settings.openings_path = value;
+        else if (option == "-tc") {
+            double base = 0, inc = 0;
+            std::sscanf(value.c_str(), "%lf+%lf", &base, &inc);
+            settings.base_time = int(base * 1000), settings.increment = int(inc * 1000);
+        }
+        else if (option == "-movetime") settings.movetime = std::atoi(value.c_str());
+        else if (option == "-depth") settings.depth = std::atoi(value.c_str());
+        else if (option == "-games") settings.games = std::atoi(value.c_str());
+        else if (option == "-concurrency") settings.concurrency = std::max(std::atoi(value.c_str()), 1);
+        else if (option == "-sprt") std::sscanf(value.c_str(), "%lf,%lf", &settings.elo0, &settings.elo1);
+        else if (option == "-seed") settings.seed = unsigned(std::atoi(value.c_str()));
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!configured[0] || !configured[1]) {
+        print_usage();
+        return 1;
+    }
+
+    bitbase::init();
+    engine::set_interactive(false);
+
+    if (!settings.concurrency) {
+        int threads = std::max(configs[0].threads, configs[1].threads);
+        settings.concurrency = std::max(int(std::thread::hardware_concurrency()) / threads, 1);
+    }
+
+    std::vector<std::string> openings;
+
+    if (!settings.openings_path.empty())
+        openings = load_openings(settings.openings_path);
+
+    if (openings.empty()) {
+        std::printf("No openings loaded, every game starts from the initial position\n");
+        openings.push_back(match_start_fen);
+    }
+
+    std::shuffle(openings.begin(), openings.end(), std::mt19937(settings.seed));
+
+    double lower = std::log(settings.beta / (1 - settings.alpha));
+    double upper = std::log((1 - settings.beta) / settings.alpha);
+
+    match_results results;
+    std::mutex results_lock;
+    std::atomic<bool> decided = false;
+
+    // The waiting thread plays games too
+    task_scheduler scheduler(settings.concurrency - 1);
+    task_group games(scheduler);
+
+    std::printf("Playing %d games at once\n", settings.concurrency);
+
+    for (int game = 0; game < settings.games; game++) {
+        games.run([&, game] {
+            // Games still queued when the test is decided aren't played
+            if (decided)
+                return;
+
+            // Both engines play every opening once with each color
+            const std::string &opening = openings[game / 2 % openings.size()];
+            bool a_white = game % 2 == 0;
+            const engine_config &white = configs[!a_white], &black = configs[a_white];
+
+            const char *reason;
+            int white_score = play_game(white, black, opening, settings, reason);
+            int a_score = a_white ? white_score : 2 - white_score;
+
+            std::lock_guard<std::mutex> lock(results_lock);
+
+            // Games that were already running when the test was decided don't count
+            if (decided)
+                return;
+
+            if (a_score == 2) results.wins++;
+            else if (a_score == 1) results.draws++;
+            else results.losses++;
+
+            static const char *result_names[] = { "0-1", "1/2-1/2", "1-0" };
+            std::printf("Game %i: %s vs %s, %s (%s)\n",
+                game + 1, white.name.c_str(), black.name.c_str(), result_names[white_score], reason);
+
+            double se = std::sqrt(results.variance() / results.games());
+            double elo = score_to_elo(results.score());
+            double margin = (score_to_elo(results.score() + 1.96 * se) - score_to_elo(results.score() - 1.96 * se)) / 2;
+            double llr = sprt_llr(results, settings.elo0, settings.elo1);
+
+            std::printf("Score of %s vs %s: %i - %i - %i, Elo %.1f +/- %.1f, LLR %.2f (%.2f, %.2f)\n",
+                configs[0].name.c_str(), configs[1].name.c_str(),
+                results.wins, results.losses, results.draws, elo, margin, llr, lower, upper);
+
+            if (llr >= upper || llr <= lower) {
+                std::printf("SPRT: %s accepted\n", llr >= upper ? "H1" : "H0");
+                decided = true;
+            }
+        });
+    }
+
+    games.wait();
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "metrics.hh"
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <sstream>
+
+constexpr int max_buckets = 12;
+
+struct counter_spec {
+    const char *name, *help;
+};
+
+struct histogram_spec {
+    const char *name, *help;
+    double bounds[max_buckets];
+    int count;
+};
+
+const counter_spec counter_specs[metrics::counter_count] = {
+    { "chess_requests_total", "Move requests received" },
+    { "chess_request_errors_total", "Move requests rejected as malformed" },
+    { "chess_book_moves_total", "Moves answered from the opening book" },
+    { "chess_cached_results_total", "Moves answered from the result cache" },
+    { "chess_searches_total", "Completed searches" },
+    { "chess_search_nodes_total", "Nodes visited by searches" },
+    { "chess_tt_probes_total", "Transposition table probes" },
+    { "chess_tt_hits_total", "Probes that found the same position" },
+    { "chess_tt_collisions_total", "Probes that found a different position in the slot" },
+    { "chess_beta_cutoffs_total", "Nodes that failed high" },
+    { "chess_first_move_cutoffs_total", "Nodes that failed high on their first move" },
+    { "chess_tt_move_searches_total", "Nodes that searched the stored best move before generating moves" },
+    { "chess_tt_move_cutoffs_total", "Nodes that failed high on the stored best move without generating moves" },
+};
+
+const histogram_spec histogram_specs[metrics::histogram_count] = {
+    { "chess_request_latency_seconds", "Time from receiving a move request to replying",
+        { 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 }, 12 },
+    { "chess_queue_wait_seconds", "Time a request waited for the engine",
+        { 0.0001, 0.001, 0.01, 0.1, 0.5, 1, 5, 10, 30 }, 9 },
+    { "chess_search_depth", "Deepest completed iteration of a search",
+        { 2, 4, 6, 8, 10, 12, 16, 20, 32, 64 }, 10 },
+    { "chess_nodes_per_second", "Search speed",
+        { 1e4, 3e4, 1e5, 3e5, 1e6, 3e6, 1e7, 3e7 }, 8 },
+};
+
+// Only the owning thread writes to a shard, so plain loads and stores are enough
+struct metrics_shard {
+    std::atomic<unsigned long long> counters[metrics::counter_count];
+    std::atomic<unsigned long long> buckets[metrics::histogram_count][max_buckets + 1];
+    std::atomic<double> sums[metrics::histogram_count];
+};
+
+std::mutex shards_lock;
+
+// Shards outlive their threads, whatever they counted is still reported
+std::vector<std::unique_ptr<metrics_shard>> shards;
+
+std::atomic<int> metrics::active_searches = 0;
+
+metrics_shard &local_shard() {
+    thread_local metrics_shard *shard = [] {
+        auto s = std::make_unique<metrics_shard>();
+        std::lock_guard<std::mutex> lock(shards_lock);
+        shards.push_back(std::move(s));
+        return shards.back().get();
+    }();
+
+    return *shard;
+}
+
+template<class T> inline void bump(std::atomic<T> &value, T by) {
+    value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+void metrics::add(counter_id id, unsigned long long value) {
+    bump(local_shard().counters[id], value);
+}
+
+void metrics::observe(histogram_id id, double value) {
+    const histogram_spec &spec = histogram_specs[id];
+    metrics_shard &shard = local_shard();
+
+    int bucket = 0;
+
+    while (bucket < spec.count && value > spec.bounds[bucket])
+        bucket++;
+
+    bump(shard.buckets[id][bucket], 1ull);
+    bump(shard.sums[id], value);
+}
+
+std::string metrics::render() {
+    std::lock_guard<std::mutex> lock(shards_lock);
+    std::ostringstream oss;
+
+    for (int i = 0; i < counter_count; i++) {
+        unsigned long long total = 0;
+
+        for (auto &shard : shards)
+            total += shard->counters[i].load(std::memory_order_relaxed);
+
+        oss << "# HELP " << counter_specs[i].name << ' ' << counter_specs[i].help << '\n';
+        oss << "# TYPE " << counter_specs[i].name << " counter\n";
+        oss << counter_specs[i].name << ' ' << total << '\n';
+    }
+
+    oss << "# HELP chess_active_searches Searches currently running\n";
+    oss << "# TYPE chess_active_searches gauge\n";
+    oss << "chess_active_searches " << active_searches.load() << '\n';
+
+    for (int i = 0; i < histogram_count; i++) {
+        const histogram_spec &spec = histogram_specs[i];
+        unsigned long long cumulative = 0;
+        double sum = 0;
+
+        oss << "# HELP " << spec.name << ' ' << spec.help << '\n';
+        oss << "# TYPE " << spec.name << " histogram\n";
+
+        for (int b = 0; b <= spec.count; b++) {
+            for (auto &shard : shards)
+                cumulative += shard->buckets[i][b].load(std::memory_order_relaxed);
+
+            oss << spec.name << "_bucket{le=\"";
+
+            if (b < spec.count)
+                oss << spec.bounds[b];
+            else
+                oss << "+Inf";
+
+            oss << "\"} " << cumulative << '\n';
+        }
+
+        for (auto &shard : shards)
+            sum += shard->sums[i].load(std::memory_order_relaxed);
+
+        oss << spec.name << "_sum " << sum << '\n';
+        oss << spec.name << "_count " << cumulative << '\n';
+    }
+
+    return oss.str();
+}
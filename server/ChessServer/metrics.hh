@@ -0,0 +1,27 @@
+#pragma once
+#include <atomic>
+#include <string>
+
+// Counters and histograms in the Prometheus text format. Every thread writes
+// to its own shard, the shards are only summed up when rendered
+namespace metrics
+{
+    enum counter_id {
+        requests, request_errors, book_moves, cached_results, searches, search_nodes,
+        tt_probes, tt_hits, tt_collisions, beta_cutoffs, first_move_cutoffs,
+        tt_move_searches, tt_move_cutoffs,
+        counter_count
+    };
+
+    enum histogram_id {
+        request_latency, queue_wait, search_depth, nodes_per_second,
+        histogram_count
+    };
+
+    extern std::atomic<int> active_searches;
+
+    void add(counter_id id, unsigned long long value = 1);
+    void observe(histogram_id id, double value);
+
+    std::string render();
+}
@@ -0,0 +1,376 @@
+#include "protocol.hh"
+#include "search.hh"
+#include <charconv>
+#include <sstream>
+
+constexpr int max_request_depth = 64;
+constexpr int max_request_time = 30;
+
+inline int digit_hex_to_int(char x) {
+    return x >= 'a' ? x - 'a' + 10 : x - '0';
+}
+
+inline void put_piece(chessboard &board, int i, int data) {
+    board.pieces[i] = data;
+
+    if (data) {
+        board.side_sets[data >> side_shift] |= 1ull << i;
+        board.piece_sets[data & type_mask] |= 1ull << i;
+    }
+}
+
+// Validates and plays a move while tracking the positions that can still repeat
+request_error apply_move(chessboard &board, const chessmove &m, std::vector<size_t> &history) {
+    if (!board.valid_pos(m.org_x, m.org_y) || !board.valid_pos(m.dest_x, m.dest_y))
+        return request_error::move_format;
+
+    bits legal_moves[64] = { 0 };
+
+    board.generate_moves(board.side_to_move, legal_moves);
+
+    if (~legal_moves[m.org_x + m.org_y * 8] & (1ull << m.dest_x + m.dest_y * 8))
+        return request_error::illegal_move;
+
+    bool irreversible =
+        board.piecetype(m.dest_x, m.dest_y) ||
+        (board.piecetype(m.org_x, m.org_y) & type_mask) == pawn;
+
+    board.make_move(m.org_x, m.org_y, m.dest_x, m.dest_y);
+
+    if (irreversible)
+        history.clear();
+
+    history.push_back(board.hash);
+    return request_error::none;
+}
+
+request_error validate_limits(const game_request &request) {
+    if (request.max_depth <= 0 || request.max_depth > max_request_depth)
+        return request_error::depth;
+
+    if (request.max_time <= 0 || request.max_time > max_request_time)
+        return request_error::time;
+
+    return request_error::none;
+}
+
+request_error parse_v1(std::string_view body, chessboard &board, game_request &request) {
+    std::istringstream iss(std::string(body.data(), body.size()));
+    char line[66] = {};
+
+    iss.getline(line, 65);
+
+    for (int i = 0; i < 64; i++) {
+        if (line[i] >= '0' && line[i] <= '9' || line[i] >= 'a' && line[i] <= 'f') {
+            int data = digit_hex_to_int(line[i]);
+            int type = data & type_mask;
+
+            if (data && type > pawn || type == 0 && data)
+                return request_error::piece_format;
+
+            put_piece(board, i, data);
+        }
+        else
+            return request_error::piece_format;
+    }
+
+    int moves = 0;
+    iss >> request.max_depth >> request.max_time >> moves;
+
+    if (request_error e = validate_limits(request); e != request_error::none)
+        return e;
+
+    // Castling rights are implied by kings and rooks on their original squares
+    board.validate_castling();
+
+    // Initial hash for the board
+    board.hash = board.zobrist();
+    board.checkers = board.find_checkers();
+    request.history.assign(1, board.hash);
+
+    chessmove m;
+
+    for (int i = 0; i < moves; i++) {
+        iss >> m.org_x >> m.org_y >> m.dest_x >> m.dest_y;
+        iss.ignore();
+
+        if (request_error e = apply_move(board, m, request.history); e != request_error::none)
+            return e;
+    }
+
+    return request_error::none;
+}
+
+// Splits off the next whitespace separated token without copying
+inline std::string_view next_token(std::string_view &s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+
+    if (start == std::string_view::npos) {
+        s = {};
+        return {};
+    }
+
+    size_t end = s.find_first_of(" \t\r\n", start);
+    std::string_view token = s.substr(start, end == std::string_view::npos ? s.npos : end - start);
+    s.remove_prefix(end == std::string_view::npos ? s.size() : end);
+    return token;
+}
+
+template<class T> inline bool parse_int(std::string_view token, T &value) {
+    auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+    return ec == std::errc() && ptr == token.data() + token.size();
+}
+
+inline bool parse_square(std::string_view s, int &x, int &y) {
+    if (s.size() != 2 || s[0] < 'a' || s[0] > 'h' || s[1] < '1' || s[1] > '8')
+        return false;
+
+    x = s[0] - 'a', y = '8' - s[1];
+    return true;
+}
+
+request_error parse_fen(std::string_view &rest, chessboard &board, std::vector<size_t> &history) {
+    std::string_view placement = next_token(rest);
+    int x = 0, y = 0;
+
+    for (char c : placement) {
+        static const char letters[] = " kqbnrp";
+
+        if (c == '/') {
+            if (x != 8 || ++y > 7)
+                return request_error::fen_placement;
+            x = 0;
+        }
+        else if (c >= '1' && c <= '8') {
+            if ((x += c - '0') > 8)
+                return request_error::fen_placement;
+        }
+        else {
+            const char *p = std::char_traits<char>::find(letters + 1, 6, char(c | 0x20));
+
+            if (!p || x > 7)
+                return request_error::fen_placement;
+
+            int side = c < 'a' ? 1 : 0;
+            put_piece(board, x++ + y * 8, int(p - letters) | side << side_shift);
+        }
+    }
+
+    if (x != 8 || y != 7 ||
+        __popcnt64(board.piece_sets[king] & board.side_sets[0]) != 1 ||
+        __popcnt64(board.piece_sets[king] & board.side_sets[1]) != 1 ||
+        board.piece_sets[pawn] & (255ull | 255ull << 56))
+        return request_error::fen_placement;
+
+    std::string_view side = next_token(rest);
+
+    if (side != "w" && side != "b")
+        return request_error::fen_side;
+
+    board.side_to_move = side == "w";
+
+    board.castling = 0;
+
+    std::string_view castling = next_token(rest);
+
+    if (castling != "-") {
+        for (char c : castling) {
+            int side = c < 'a' ? 1 : 0, y = side * 7;
+            int rook_x = (c | 0x20) == 'k' ? 7 : (c | 0x20) == 'q' ? 0 : -1;
+
+            if (rook_x < 0 ||
+                board.pieces[4 + y * 8] != (king | side << side_shift) ||
+                board.pieces[rook_x + y * 8] != (rook | side << side_shift))
+                return request_error::fen_castling;
+
+            board.castling |= rook_x ? castle_kingside(side) : castle_queenside(side);
+        }
+    }
+
+    board.hash = board.zobrist();
+    board.checkers = board.find_checkers();
+    history.assign(1, board.hash);
+
+    std::string_view en_passant = next_token(rest);
+
+    if (en_passant != "-") {
+        int ex, ey;
+
+        // The pawn that just moved two squares stands one rank past the target
+        if (!parse_square(en_passant, ex, ey) || ey != (board.side_to_move ? 2 : 5))
+            return request_error::fen_en_passant;
+
+        int dir = board.side_to_move ? 1 : -1;
+        int org_y = ey - dir, dest_y = ey + dir;
+
+        if (board.pieces[ex + dest_y * 8] != (pawn | (board.side_to_move ^ 1) << side_shift) ||
+            board.pieces[ex + ey * 8] || board.pieces[ex + org_y * 8])
+            return request_error::fen_en_passant;
+
+        board.en_passant = ex + ey * 8;
+        board.hash = board.zobrist();
+        history.assign(1, board.hash);
+    }
+
+    // Clocks are optional
+    std::string_view lookahead = rest;
+    int halfmove, fullmove;
+
+    if (parse_int(next_token(lookahead), halfmove)) {
+        next_token(rest);
+
+        if (halfmove < 0 || !parse_int(next_token(rest), fullmove) || fullmove < 1)
+            return request_error::fen_clock;
+
+        board.halfmove_clock = halfmove;
+        board.move_count = (fullmove - 1) * 2 + (board.side_to_move ^ 1);
+    }
+
+    return request_error::none;
+}
+
+request_error protocol::parse_limits(std::string_view &rest, game_request &request) {
+    if (!parse_int(next_token(rest), request.max_depth))
+        return request_error::depth;
+
+    if (!parse_int(next_token(rest), request.max_time))
+        return request_error::time;
+
+    // Optional limits come before the position, whose first field always has slashes
+    for (;;) {
+        std::string_view lookahead = rest, token = next_token(lookahead);
+
+        if (token == "deterministic")
+            request.deterministic = true;
+        else if (token == "nodes") {
+            if (!parse_int(next_token(lookahead), request.max_nodes) || request.max_nodes <= 0)
+                return request_error::nodes;
+        }
+        else if (token == "multipv") {
+            if (!parse_int(next_token(lookahead), request.multipv) ||
+                request.multipv <= 0 || request.multipv > max_multipv)
+                return request_error::multipv;
+        }
+        else if (token == "skill") {
+            if (!parse_int(next_token(lookahead), request.skill) ||
+                request.skill < 0 || request.skill > max_skill)
+                return request_error::skill;
+        }
+        else if (token == "movetime") {
+            if (!parse_int(next_token(lookahead), request.movetime) ||
+                request.movetime <= 0 || request.movetime > max_request_time * 1000)
+                return request_error::time;
+        }
+        else
+            break;
+
+        rest = lookahead;
+    }
+
+    return validate_limits(request);
+}
+
+request_error parse_v2(std::string_view body, chessboard &board, game_request &request) {
+    next_token(body);
+
+    if (request_error e = protocol::parse_limits(body, request); e != request_error::none)
+        return e;
+
+    return protocol::parse_position(body, board, request.history);
+}
+
+request_error protocol::parse_position(std::string_view position, chessboard &board, std::vector<size_t> &history) {
+    if (request_error e = parse_fen(position, board, history); e != request_error::none)
+        return e;
+
+    for (std::string_view token = next_token(position); !token.empty(); token = next_token(position)) {
+        chessmove m;
+
+        if (token.size() < 4 || token.size() > 5 ||
+            !parse_square(token.substr(0, 2), m.org_x, m.org_y) ||
+            !parse_square(token.substr(2, 2), m.dest_x, m.dest_y))
+            return request_error::move_format;
+
+        // Pawns always promote to a queen here
+        if (token.size() == 5 && token[4] != 'q')
+            return request_error::promotion;
+
+        if (request_error e = apply_move(board, m, history); e != request_error::none)
+            return e;
+    }
+
+    return request_error::none;
+}
+
+request_error protocol::parse(std::string_view body, chessboard &board, game_request &request) {
+    std::string_view rest = body;
+    std::string_view version = next_token(rest);
+
+    if (version.size() == 2 && version[0] == 'v') {
+        if (version != "v2")
+            return request_error::version;
+
+        request.version = 2;
+        return parse_v2(body, board, request);
+    }
+
+    request.version = 1;
+    return parse_v1(body, board, request);
+}
+
+const char *protocol::describe(request_error error) {
+    switch (error) {
+    case request_error::none: return "OK";
+    case request_error::piece_format: return "Incorrect chess piece format";
+    case request_error::depth: return "Invalid maximum depth value";
+    case request_error::time: return "Invalid maximum time value";
+    case request_error::nodes: return "Invalid node limit";
+    case request_error::multipv: return "Invalid number of best moves";
+    case request_error::skill: return "Invalid skill level";
+    case request_error::move_format: return "Incorrect move format";
+    case request_error::illegal_move: return "Illegal move";
+    case request_error::version: return "Unsupported protocol version";
+    case request_error::fen_placement: return "Invalid FEN piece placement";
+    case request_error::fen_side: return "Invalid FEN side to move";
+    case request_error::fen_castling: return "Invalid FEN castling rights";
+    case request_error::fen_en_passant: return "Invalid FEN en passant square";
+    case request_error::fen_clock: return "Invalid FEN move clocks";
+    case request_error::promotion: return "Only promotions to a queen are supported";
+    }
+
+    return "Bad request";
+}
+
+std::string protocol::format_reply(const board_state &board, const game_request &request, const rated_move &response,
+    const std::vector<rated_move> &lines) {
+    const chessmove &m = response.move;
+
+    if (request.version == 1) {
+        std::ostringstream oss;
+        oss << m.org_x << ' ' << m.org_y << ' ' << m.dest_x << ' ' << m.dest_y;
+        return oss.str();
+    }
+
+    // A single move is the one picked for the skill level, not necessarily the best line
+    if (request.multipv < 2 || lines.size() < 2)
+        return to_uci(board, m) + ' ' + evaluation::to_string(response.value);
+
+    std::string reply;
+
+    // Weakened searches look at more lines than were asked for
+    for (size_t i = 0; i < lines.size() && i < size_t(request.multipv); i++)
+        reply += (reply.empty() ? "" : "\n") + to_uci(board, lines[i].move) + ' ' + evaluation::to_string(lines[i].value);
+
+    return reply;
+}
+
+std::string protocol::to_uci(const board_state &board, const chessmove &m) {
+    bool promotion = (board.pieces[m.org_x + m.org_y * 8] & type_mask) == pawn && (m.dest_y == 0 || m.dest_y == 7);
+
+    char uci[] = {
+        char('a' + m.org_x), char('8' - m.org_y),
+        char('a' + m.dest_x), char('8' - m.dest_y), promotion ? 'q' : 0, 0
+    };
+
+    return uci;
+}
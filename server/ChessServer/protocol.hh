@@ -0,0 +1,52 @@
+#pragma once
+#include "chess.hh"
+#include <string_view>
+
+struct rated_move;
+
+enum class request_error {
+    none,
+    piece_format, depth, time, nodes, multipv, skill, move_format, illegal_move,
+    version, fen_placement, fen_side, fen_castling, fen_en_passant, fen_clock, promotion
+};
+
+struct game_request {
+    int max_depth = 0, max_time = 0;
+    int version = 1;
+
+    // Optional v2 limits, movetime is in milliseconds and replaces max_time
+    long long max_nodes = 0;
+    int movetime = 0;
+    bool deterministic = false;
+
+    // Number of best moves in the reply and playing strength from 0 to 20
+    int multipv = 1, skill = 20;
+
+    // Positions since the last capture or pawn move, these decide repetitions
+    std::vector<size_t> history;
+};
+
+// Request bodies of /chess_engine. Version 1 is a 64 digit hex board followed by
+// "depth time count" and one "x y x y" line per move, version 2 is
+//     v2 <depth> <time> [nodes <count>] [movetime <ms>] [multipv <k>] [skill <0-20>] [deterministic]
+//     <FEN>
+//     <UCI move> <UCI move> ...
+// where the position is given directly instead of being replayed from the start
+namespace protocol
+{
+    request_error parse(std::string_view body, chessboard &board, game_request &request);
+    const char *describe(request_error error);
+
+    // Version 2 replies carry one "<UCI move> <score>" line per requested best move
+    std::string format_reply(const board_state &board, const game_request &request, const rated_move &response,
+        const std::vector<rated_move> &lines = {});
+
+    // "<depth> <time>" and the optional limits, consumed from the front of the text
+    request_error parse_limits(std::string_view &rest, game_request &request);
+
+    // A FEN followed by UCI moves, shared with the UCI front-end
+    request_error parse_position(std::string_view position, chessboard &board, std::vector<size_t> &history);
+
+    // The board is the position the move is played in, a pawn reaching the last rank gets the queen suffix
+    std::string to_uci(const board_state &board, const chessmove &m);
+}
@@ -0,0 +1,166 @@
+#include "result_cache.hh"
+#include "search.hh"
+#include <list>
+#include <mutex>
+#include <fstream>
+
+struct cache_key {
+    size_t hash, history;
+    int time_class;
+
+    inline bool operator==(const cache_key &other) const {
+        return hash == other.hash && history == other.history && time_class == other.time_class;
+    }
+};
+
+struct cache_key_hasher {
+    inline size_t operator()(const cache_key &k) const {
+        return k.hash ^ k.history * 0x9e3779b97f4a7c15ull ^ size_t(k.time_class) << 56;
+    }
+};
+
+struct cache_entry {
+    cache_key key;
+    chessmove move;
+    int value, depth;
+    bool timed_out;
+};
+
+// Entries are written raw, version 2 has the current chessmove layout and hashes
+// that cover castling rights and the en passant file
+constexpr unsigned cache_file_version = 2;
+
+std::mutex cache_lock;
+std::list<cache_entry> cache_entries; // Most recently used first
+std::unordered_map<cache_key, std::list<cache_entry>::iterator, cache_key_hasher> cache_index;
+size_t cache_capacity = 0;
+
+// Searches given time budgets in the same power-of-two bucket reach similar depths
+inline int time_class(int max_time) {
+    int c = 0;
+    while (max_time > 1) max_time >>= 1, c++;
+    return c;
+}
+
+void result_cache::init(size_t capacity) {
+    std::lock_guard<std::mutex> guard(cache_lock);
+    cache_capacity = capacity;
+    cache_index.reserve(capacity);
+}
+
+size_t result_cache::history_key(const std::vector<size_t> &history) {
+    size_t key = 0;
+
+    for (size_t h : history) {
+        // splitmix64 finalizer so that repeated positions don't cancel out
+        h += 0x9e3779b97f4a7c15ull;
+        h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ h >> 27) * 0x94d049bb133111ebull;
+        key += h ^ h >> 31;
+    }
+
+    return key;
+}
+
+bool result_cache::lookup(size_t hash, size_t history, int max_depth, int max_time, rated_move &result) {
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    auto it = cache_index.find(cache_key{ hash, history, time_class(max_time) });
+
+    if (it == cache_index.end())
+        return false;
+
+    const cache_entry &e = *it->second;
+
+    // A search that ran out of time would run out of time again with the same budget
+    if (e.depth < max_depth && !e.timed_out)
+        return false;
+
+    result.move = e.move;
+    result.value = e.value;
+
+    cache_entries.splice(cache_entries.begin(), cache_entries, it->second);
+    return true;
+}
+
+void result_cache::store(size_t hash, size_t history, int max_depth, int max_time, const rated_move &result, int reached_depth) {
+    if (result.move.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    if (!cache_capacity)
+        return;
+
+    cache_entry e{ cache_key{ hash, history, time_class(max_time) },
+        result.move, result.value, reached_depth, reached_depth < max_depth };
+
+    auto it = cache_index.find(e.key);
+
+    if (it != cache_index.end()) {
+        // Keep whichever search went deeper
+        if (it->second->depth > e.depth)
+            return;
+
+        *it->second = e;
+        cache_entries.splice(cache_entries.begin(), cache_entries, it->second);
+        return;
+    }
+
+    if (cache_entries.size() >= cache_capacity) {
+        cache_index.erase(cache_entries.back().key);
+        cache_entries.pop_back();
+    }
+
+    cache_entries.push_front(e);
+    cache_index[e.key] = cache_entries.begin();
+}
+
+bool result_cache::save(const std::string &path) {
+    std::lock_guard<std::mutex> guard(cache_lock);
+    std::ofstream os(path, std::ios::binary);
+
+    if (!os)
+        return false;
+
+    size_t count = cache_entries.size();
+    os.write((const char *)&cache_file_version, sizeof cache_file_version);
+    os.write((const char *)&count, sizeof count);
+
+    // Least recently used first, so that reloading preserves the order
+    for (auto it = cache_entries.rbegin(); it != cache_entries.rend(); ++it)
+        os.write((const char *)&*it, sizeof(cache_entry));
+
+    return bool(os);
+}
+
+bool result_cache::load(const std::string &path) {
+    std::ifstream is(path, std::ios::binary);
+    unsigned version = 0;
+    size_t count = 0;
+
+    if (!is.read((char *)&version, sizeof version) || version != cache_file_version ||
+        !is.read((char *)&count, sizeof count))
+        return false;
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    if (!cache_capacity)
+        return false;
+    cache_entry e;
+
+    while (count-- && is.read((char *)&e, sizeof e)) {
+        if (cache_index.count(e.key))
+            continue;
+
+        if (cache_entries.size() >= cache_capacity) {
+            cache_index.erase(cache_entries.back().key);
+            cache_entries.pop_back();
+        }
+
+        cache_entries.push_front(e);
+        cache_index[e.key] = cache_entries.begin();
+    }
+
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "chess.hh"
+
+struct rated_move;
+
+// Bounded LRU cache of finished root searches shared across requests
+namespace result_cache
+{
+    void init(size_t capacity);
+
+    // Order-independent key over the positions since the last capture or pawn move,
+    // which are the only ones that can still repeat
+    size_t history_key(const std::vector<size_t> &history);
+
+    // Succeeds if a cached search went at least as deep as this request would
+    bool lookup(size_t hash, size_t history, int max_depth, int max_time, rated_move &result);
+    void store(size_t hash, size_t history, int max_depth, int max_time, const rated_move &result, int reached_depth);
+
+    bool save(const std::string &path);
+    bool load(const std::string &path);
+}
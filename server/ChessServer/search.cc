@@ -1,5 +1,13 @@
 #include "search.hh"
 #include "eval.hh"
+#include "tablebase.hh"
+#include "bitbase.hh"
+#include "metrics.hh"
+#include "logger.hh"
+#include "mapped_file.hh"
+#include "large_pages.hh"
+#include "task_scheduler.hh"
+#include "search_stats.hh"
 #include <unordered_map>
 #include <chrono>
 #include "fastmap.hh"
@@ -7,6 +15,8 @@
 #include <mutex>
 #include <algorithm>
 #include <iostream>
+#include <random>
+#include <cstring>
 
 using namespace std::chrono;
 
@@ -15,27 +25,68 @@ using timepoint = steady_clock::time_point;
 class out_of_time_exception : std::exception {};
 
 struct search_config {
-    timepoint deadline;
-    eval_func eval;
-    int depth;
+    timepoint deadline = timepoint::max();
+    eval_func eval = nullptr;
+    int depth = 1;
+
+    // Nodes left for the current iteration, 0 for no limit
+    long long node_limit = 0;
+
+    // Root moves already reported as better lines in a MultiPV search
+    std::vector<chessmove> excluded;
+
+    // Tables, stop flag and counters of the searching engine
+    engine::instance *instance = nullptr;
 };
 
+inline bool same_move(const chessmove &a, const chessmove &b) {
+    return a.org_x == b.org_x && a.org_y == b.org_y && a.dest_x == b.dest_x && a.dest_y == b.dest_y;
+}
+
 constexpr int transposition_lower = 1;
 constexpr int transposition_upper = 2;
 constexpr int transposition_exact = 3;
-constexpr int max_transpositions_size = 1 << 27;
+constexpr size_t default_transpositions_size = 1 << 27;
 
 struct transposition_entry {
     size_t hash;
     int value;
     char depth, type;
 
-    inline transposition_entry(size_t hsh, int v, int d, int t)
-        : hash(hsh), value(v), depth(d), type(t) {}
+    // Squares of the best move, equal when there is none. They fill what was padding
+    unsigned char from, to;
+
+    inline transposition_entry(size_t hsh, int v, int d, int t, int f = 0, int tt = 0)
+        : hash(hsh), value(v), depth(d), type(t), from(f), to(tt) {}
 
     inline transposition_entry() {}
+
+    inline bool has_move() const { return from != to; }
+    inline chessmove move() const { return chessmove{ from & 7, from >> 3, to & 7, to >> 3 }; }
 };
 
+// Entries are either on the heap or inside a mapped file, memory keeps them alive
+struct transposition_table {
+    transposition_entry *entries = nullptr;
+    size_t mask = 0;
+    std::shared_ptr<void> memory;
+    mapped_file *file = nullptr;
+
+    inline size_t size() const { return entries ? mask + 1 : 0; }
+};
+
+// Start of a transposition table file, the entries follow at transposition_file_offset
+struct transposition_file_header {
+    char magic[8];
+    unsigned version, entry_size;
+    size_t entries, zobrist_seed, zobrist_fingerprint;
+};
+
+const char transposition_file_magic[8] = "WCHESTT";
+// Version 2 added the best move to the entries, version 3 hashes castling rights and the en passant file
+constexpr unsigned transposition_file_version = 3;
+constexpr size_t transposition_file_offset = 64;
+
 struct spinlock {
     std::atomic<bool> lock_ = { 0 };
 
@@ -57,54 +108,203 @@ struct spinlock {
     }
 };
 
-fastmap<transposition_entry, max_transpositions_size> transpositions;
-spinlock transposition_table_lock, killer_lock;
+struct engine::instance {
+    transposition_table transpositions;
+    spinlock transposition_table_lock;
+    std::atomic_bool halt_search = false;
+    std::atomic<int> nodes_examined = 0, tt_found = 0, tb_hits = 0;
+    search_features features;
+    int processor_count = std::thread::hardware_concurrency();
+
+    // Created for processor_count threads on first use
+    std::unique_ptr<task_scheduler> scheduler;
+
+    // Swapped in for deterministic searches, which start from an empty table every time
+    transposition_table deterministic_transpositions;
+
+    inline transposition_entry &transposition(size_t hash) {
+        return transpositions.entries[hash & transpositions.mask];
+    }
+
+    task_scheduler &workers() {
+        if (!scheduler || scheduler->concurrency() != processor_count)
+            scheduler = std::make_unique<task_scheduler>(processor_count - 1);
+
+        return *scheduler;
+    }
+};
+
+// The one the engine functions without an instance search with
+engine::instance default_instance;
+
+// Evaluations of every instance together
 std::atomic<int> g_total_nodes = 0;
-std::atomic_bool halt_search = false;
-std::atomic<int> nodes_examined = 0, tt_found = 0;
-std::vector<std::vector<chessmove>> killer_moves;
 
-int wait_for_keypress()
-{
-    std::cin.get();
-    halt_search = true;
-    return 0;
-}
+bool interactive_search = true;
+numa_policy memory_policy = numa_policy::first_touch;
+int memory_node = 0;
+
+// Deeper than any search goes, depth is at most 64 and extensions stop at twice the iteration depth
+constexpr int max_ply = 256;
+
+// History scores saturate at this magnitude
+constexpr int history_max = 16384;
+
+// Quiet move ordering, every search thread keeps its own so updating needs no
+// lock. Moves are coded as origin | destination << 6, and moves paired with
+// the piece that makes them as piece << 6 | destination, 0 being no move
+struct move_history {
+    unsigned short killers[max_ply][2];
+
+    // Quiet reply that refuted a move, by that move's piece and destination
+    unsigned short counter_moves[1 << 10];
+
+    // By side, origin and destination
+    short butterfly[2][1 << 12];
 
-// https://stackoverflow.com/questions/11828539/elegant-exception-handling-in-openmp
-class delayed_exception {
-    std::exception_ptr ptr;
-public:
-    delayed_exception() : ptr(nullptr) {}
+    // By how far back, one or two plies, and the piece and destination of the
+    // move that far back and of this move
+    short continuation[2][1 << 10][1 << 10];
 
-    void rethrow() {
-        if (this->ptr)
-            std::rethrow_exception(this->ptr);
+    // Piece and destination of the move made at every ply of the current line
+    unsigned short path[max_ply];
+
+    int generation;
+};
+
+// Bumped to make every thread start its history over
+std::atomic<int> history_generation = 0;
+
+move_history &local_history() {
+    thread_local std::unique_ptr<move_history> history = std::make_unique<move_history>();
+
+    int generation = history_generation.load(std::memory_order_relaxed);
+
+    if (history->generation != generation) {
+        std::memset(history.get(), 0, sizeof(move_history));
+        history->generation = generation;
     }
 
-    void capture() {
-        this->ptr = std::current_exception();
+    return *history;
+}
+
+inline int move_code(const chessmove &m) {
+    return (m.org_x + m.org_y * 8) | (m.dest_x + m.dest_y * 8) << 6;
+}
+
+inline int piece_to(const chessboard &board, const chessmove &m) {
+    return board.pieces[m.org_x + m.org_y * 8] << 6 | (m.dest_x + m.dest_y * 8);
+}
+
+inline bool is_quiet(const chessboard &board, const chessmove &m) {
+    bool en_passant = (board.pieces[m.org_x + m.org_y * 8] & type_mask) == pawn && m.org_x != m.dest_x;
+    return !board.pieces[m.dest_x + m.dest_y * 8] && !en_passant;
+}
+
+// Moves that fail high are pushed up and the ones searched before them down,
+// the further the less room is left towards history_max
+inline void apply_gravity(short &entry, int bonus) {
+    entry += bonus - entry * std::abs(bonus) / history_max;
+}
+
+inline int quiet_score(const move_history &history, const chessboard &board,
+    const chessmove &m, int previous, int before_previous) {
+    int current = piece_to(board, m);
+
+    return history.butterfly[board.side_to_move][move_code(m)] +
+        (previous ? history.continuation[0][previous][current] : 0) +
+        (before_previous ? history.continuation[1][before_previous][current] : 0);
+}
+
+// Called with the node's position on the board when best fails high
+void update_history(move_history &history, const chessboard &board, int ply, int depth,
+    int previous, int before_previous, const chessmove &best, const std::vector<chessmove> &quiets) {
+    if (!is_quiet(board, best))
+        return;
+
+    int bonus = std::min(16 * depth * depth, 1600);
+
+    for (const chessmove &m : quiets) {
+        int b = same_move(m, best) ? bonus : -bonus;
+        int current = piece_to(board, m);
+
+        apply_gravity(history.butterfly[board.side_to_move][move_code(m)], b);
+
+        if (previous)
+            apply_gravity(history.continuation[0][previous][current], b);
+
+        if (before_previous)
+            apply_gravity(history.continuation[1][before_previous][current], b);
     }
 
-    template <typename function, typename... parameters>
-    void run(function f, parameters... params)
-    {
-        try { f(params...); }
-        catch (...) { capture(); }
+    int code = move_code(best);
+
+    if (ply >= 2 && history.killers[ply][0] != code) {
+        history.killers[ply][1] = history.killers[ply][0];
+        history.killers[ply][0] = code;
     }
-};
+
+    if (previous)
+        history.counter_moves[previous] = code;
+}
+
+inline size_t table_entries(size_t megabytes) {
+    size_t entries = 1;
+
+    while (entries * 2 * sizeof(transposition_entry) <= megabytes << 20)
+        entries *= 2;
+
+    return entries;
+}
+
+// Every search thread clears its own share, which under first touch also
+// spreads the pages over the nodes the threads run on
+void clear_transpositions(transposition_table &t, int threads) {
+    size_t count = t.size();
+
+#pragma omp parallel for num_threads(threads)
+    for (int i = 0; i < threads; i++)
+        std::fill(t.entries + count * i / threads, t.entries + count * (i + 1) / threads,
+            transposition_entry(0, 0, 0, 0));
+}
+
+transposition_table allocate_transpositions(size_t entries, int threads) {
+    size_t bytes = entries * sizeof(transposition_entry);
+
+    transposition_table t;
+    t.entries = (transposition_entry *)large_pages::allocate(bytes, memory_policy, memory_node);
+
+    if (!t.entries)
+        throw std::bad_alloc();
+
+    t.mask = entries - 1;
+    t.memory = std::shared_ptr<void>(t.entries, [bytes](void *memory) { large_pages::release(memory, bytes); });
+    clear_transpositions(t, threads);
+    return t;
+}
+
+int wait_for_keypress(engine::instance &instance)
+{
+    std::cin.get();
+    instance.halt_search = true;
+    return 0;
+}
 
 int timed_negamax_search(bool parallel,
     chessboard &board, int depth, int alpha, int beta, rated_move *move,
-    const search_config &config, bool quiescence = false);
-
-const int processor_count = std::thread::hardware_concurrency();
+    const search_config &config, const chessmove *excluded_move = nullptr);
 
 int search_helper(rated_move& to_make, bool search_pv, int move_index,
     chessboard &board, int depth, int alpha, int beta, rated_move *move,
-    const search_config &config, bool quiescence = false)
+    const search_config &config)
 {
-    bool capture = board.pieces[to_make.move.dest_x + to_make.move.dest_y * 8];
+    int org = to_make.move.org_x + to_make.move.org_y * 8, dest = to_make.move.dest_x + to_make.move.dest_y * 8;
+    bool capture = board.pieces[dest];
+
+    // Neither evasions nor checks are reduced
+    bool tactical = capture || board.checkers || board.gives_check(org, dest);
+
+    local_history().path[board.appended_moves] = piece_to(board, to_make.move);
 
     board.make_move(
         to_make.move.org_x, to_make.move.org_y,
@@ -114,24 +314,25 @@ int search_helper(rated_move& to_make, bool search_pv, int move_index,
     int m, r = 0;
 
     // Late move pruning
-    if (!quiescence &&
+    if (config.instance->features.late_move_reductions &&
         depth >= 3 && move_index >= 3 &&
-        !board.in_check(board.side_to_move ^ 1) &&
-        !board.in_check(board.side_to_move) &&
-        !capture) {
+        !tactical) {
         r = move_index >= 9 ? depth / 3 : 1;
-        m = -timed_negamax_search(false, board, depth - r - 1, -alpha - 1, -alpha, nullptr, config, quiescence);
+        search_stats::add(search_stats::reduced_searches);
+        m = -timed_negamax_search(false, board, depth - r - 1, -alpha - 1, -alpha, nullptr, config);
         
-        if (m > alpha)
-            m = -timed_negamax_search(false, board, depth - 1, -beta, -alpha, nullptr, config, quiescence);
+        if (m > alpha) {
+            search_stats::add(search_stats::re_searches);
+            m = -timed_negamax_search(false, board, depth - 1, -beta, -alpha, nullptr, config);
+        }
     }
     else {
         if (search_pv)
-            m = -timed_negamax_search(false, board, depth - 1, -beta, -alpha, nullptr, config, quiescence);
+            m = -timed_negamax_search(false, board, depth - 1, -beta, -alpha, nullptr, config);
         else {
-            m = -timed_negamax_search(false, board, depth - 1, -alpha - 1, -alpha, nullptr, config, quiescence);
+            m = -timed_negamax_search(false, board, depth - 1, -alpha - 1, -alpha, nullptr, config);
             if (m > alpha)
-                m = -timed_negamax_search(false, board, depth - 1, -beta, -alpha, nullptr, config, quiescence);
+                m = -timed_negamax_search(false, board, depth - 1, -beta, -alpha, nullptr, config);
         }
     }
 
@@ -141,11 +342,181 @@ int search_helper(rated_move& to_make, bool search_pv, int move_index,
     return m;
 }
 
+// Deterministic searches start from an empty table of their own every time
+constexpr size_t deterministic_hash_size = 16;
+
+// Skill levels below the maximum choose among this many best moves
+constexpr int skill_candidates = 4;
+
+// Only one in this many searches logs every iteration
+constexpr int iteration_log_sample = 8;
+
+// Margin on top of the captured piece's value before a capture is considered hopeless
+constexpr int delta_margin = 200;
+
+// Nodes at least this deep without a TT move are searched one ply shallower
+constexpr int iir_depth = 4;
+
+// Singular extensions are tried from this depth, a move is singular when the
+// others score below the stored bound minus this margin per ply
+constexpr int singular_depth = 6;
+constexpr int singular_margin = 3;
+
+int quiescence_search(chessboard &board, int alpha, int beta, const search_config &config)
+{
+    int side = board.side_to_move;
+    engine::instance &instance = *config.instance;
+
+    instance.nodes_examined++;
+    search_stats::qnode(board.appended_moves);
+
+    int known;
+
+    if (board.count_pieces() == 3 && bitbase::probe(board, known))
+        return known;
+
+    bits bm[64];
+    std::memset(bm, 0, sizeof bm);
+
+    // When in check every evasion has to be considered, not just captures
+    if (board.in_check(side)) {
+        board.generate_moves(side, bm);
+
+        bool any = false;
+
+        for (int i = 0; i < 64; i++) {
+            unsigned long ind;
+
+            for (bits mask = bm[i]; mask; mask &= mask - 1) {
+                _BitScanForward64(&ind, mask);
+
+                any = true;
+
+                board.make_move(i & 7, i >> 3, ind & 7, ind >> 3);
+                board.appended_moves++;
+                int m = -quiescence_search(board, -beta, -alpha, config);
+                board.unmake_move();
+                board.appended_moves--;
+
+                if (m > alpha)
+                    alpha = m;
+
+                if (alpha >= beta)
+                    return alpha;
+            }
+        }
+
+        return any ? alpha : -INT_MAX + board.appended_moves;
+    }
+
+    int stand_pat = config.eval(board, side);
+
+    if (stand_pat >= beta)
+        return beta;
+
+    if (alpha < stand_pat)
+        alpha = stand_pat;
+
+    if (!board.generate_captures(side, bm))
+        return alpha;
+
+    // Delta pruning is unsafe with little material left
+    bool use_delta = instance.features.delta_pruning && board.count_pieces() > 6;
+
+    struct capture { int value, org, dest; };
+    capture captures[256];
+    int count = 0;
+
+    for (int i = 0; i < 64; i++) {
+        unsigned long ind;
+
+        for (bits mask = bm[i]; mask; mask &= mask - 1) {
+            _BitScanForward64(&ind, mask);
+
+            int capturing = board.pieces[i] & type_mask;
+            int captured = board.pieces[ind] & type_mask;
+
+            // En passant
+            if (!captured && capturing == pawn && (i & 7) != (ind & 7))
+                captured = pawn;
+
+            bool promotion = capturing == pawn && int(ind >> 3) == (1 - side) * 7;
+            int gain = piece_values[captured] + promotion * (piece_values[queen] - piece_values[pawn]);
+
+            if (use_delta && stand_pat + gain + delta_margin <= alpha)
+                continue;
+
+            // Skip captures that lose material outright
+            if (instance.features.see_pruning && !promotion && board.see(i, ind) < 0)
+                continue;
+
+            // MVV-LVA
+            captures[count++] = capture{ gain * 2048 - piece_values[capturing], i, int(ind) };
+        }
+    }
+
+    // Insertion sort
+    for (int i = 1; i < count; i++)
+        for (int j = i; j > 0 && captures[j - 1].value < captures[j].value; j--)
+            std::swap(captures[j - 1], captures[j]);
+
+    for (int i = 0; i < count; i++) {
+        int org = captures[i].org, dest = captures[i].dest;
+
+        // Captures are generated pseudo-legally
+        if (!board.is_move_safe(side, org & 7, org >> 3, dest & 7, dest >> 3))
+            continue;
+
+        board.make_move(org & 7, org >> 3, dest & 7, dest >> 3);
+        board.appended_moves++;
+        int m = -quiescence_search(board, -beta, -alpha, config);
+        board.unmake_move();
+        board.appended_moves--;
+
+        if (m > alpha)
+            alpha = m;
+
+        if (alpha >= beta)
+            break;
+    }
+
+    return alpha;
+}
+
+void store_transposition(engine::instance &instance, size_t hash, const rated_move &best_move,
+    int depth, int orig_alpha, int beta) {
+    int from = best_move.move.org_x + best_move.move.org_y * 8;
+    int to = best_move.move.dest_x + best_move.move.dest_y * 8;
+    auto e = transposition_entry(hash, best_move.value, depth, 0, from, to);
+
+    if (best_move.value <= orig_alpha)
+        e.type = transposition_upper;
+    else if (best_move.value >= beta)
+        e.type = transposition_lower;
+    else
+        e.type = transposition_exact;
+
+    std::lock_guard<spinlock> guard(instance.transposition_table_lock);
+    instance.transposition(hash) = e;
+}
+
+// Another position can share the hash of this one, and a move stored by it may
+// not even be possible here, so the stored move is checked against the legal moves
+inline bool legal_tt_move(chessboard &board, int side, const chessmove &m) {
+    int from = m.org_x + m.org_y * 8, to = m.dest_x + m.dest_y * 8;
+    bits bm[64] = { 0 };
+
+    board.generate_moves(side, bm, false, false, 1ull << to);
+    return bm[from] >> to & 1;
+}
+
 #include <omp.h>
 
+// excluded_move is left out of this node's moves, for singular extension checks.
+// Such searches neither use nor update the transposition table for the node
 int timed_negamax_search(bool parallel,
     chessboard &board, int depth, int alpha, int beta, rated_move *move,
-    const search_config &config, bool quiescence) {
+    const search_config &config, const chessmove *excluded_move) {
     rated_move best_move;
 
     int orig_alpha = alpha;
@@ -153,109 +524,209 @@ int timed_negamax_search(bool parallel,
     int side = board.side_to_move;
 
     size_t z = board.hash;
+    engine::instance &instance = *config.instance;
 
-    nodes_examined++;
+    instance.nodes_examined++;
+    search_stats::node(board.appended_moves);
 
-    // Threefold repetition is a draw
-    if (board.previous_states[z] + 1 >= 3)
+    // Threefold repetition is a draw, the root still has to pick a move
+    if (!move && board.previous_states[z] + 1 >= 3)
         return 0;
 
-    {
-        std::lock_guard<spinlock> lock(transposition_table_lock);
-        // Memoization
-        if (!move && transpositions[z].type && transpositions[z].hash == z) {
+    // Move and bounds stored for this position, for the refinements below
+    transposition_entry tt_entry(0, 0, 0, 0);
+    bool probe = !move && !excluded_move;
+
+    // Memoization, only the copy is taken under the lock
+    transposition_entry stored(0, 0, 0, 0);
+
+    if (probe) {
+        std::lock_guard<spinlock> lock(instance.transposition_table_lock);
+        stored = instance.transposition(z);
+    }
 
-            auto entry = transpositions[z];
+    if (probe) {
+        metrics::add(metrics::tt_probes);
+        search_stats::add(search_stats::tt_probes);
+    }
+
+    if (probe && stored.type && stored.hash != z) {
+        metrics::add(metrics::tt_collisions);
+        search_stats::add(search_stats::tt_collisions);
+    }
+
+    if (probe && stored.type && stored.hash == z) {
+        metrics::add(metrics::tt_hits);
+        search_stats::add(search_stats::tt_hits);
+
+        auto entry = tt_entry = stored;
 
-            if (entry.depth >= depth) {
-                tt_found++;
-                switch (entry.type) {
-                case transposition_exact: return
+        if (entry.depth >= depth) {
+            instance.tt_found++;
+            switch (entry.type) {
+            case transposition_exact:
+                search_stats::add(search_stats::tt_cutoffs);
+                return
                     entry.value >= +INT_MAX - 256 ? entry.value - board.appended_moves :
                     entry.value <= -INT_MAX + 256 ? entry.value + board.appended_moves :
                     entry.value;
-                case transposition_lower: alpha = std::max(alpha, entry.value); break;
-                case transposition_upper: beta = std::min(beta, entry.value); break;
-                }
+            case transposition_lower: alpha = std::max(alpha, entry.value); break;
+            case transposition_upper: beta = std::min(beta, entry.value); break;
+            }
 
-                if (alpha >= beta)
-                    return entry.value;
+            if (alpha >= beta) {
+                search_stats::add(search_stats::tt_cutoffs);
+                return entry.value;
             }
         }
     }
 
-    if (depth >= 2 && (high_resolution_clock::now() >= config.deadline || halt_search)) {
-        for (int i = 0; i < board.appended_moves; i++)
-            board.unmake_move();
-        throw out_of_time_exception();
+    // Endgame tablebases
+    if (instance.features.tablebases && probe && board.count_pieces() <= size_t(tablebase::max_pieces())) {
+        int wdl;
+
+        if (tablebase::probe_wdl(board, wdl)) {
+            instance.tb_hits++;
+            return tablebase::wdl_to_score(wdl, board.appended_moves);
+        }
     }
 
-    bool checked = board.in_check(side);
+    // Built-in bitbases for the most common small endgames
+    if (probe && board.count_pieces() == 3) {
+        int known;
 
-    // Checkmate for this side or a stalemate
-    if (!board.any_moves(side))
-        return checked ? -INT_MAX + board.appended_moves : 0;
-
-    int board_val = config.eval(board, side);
+        if (bitbase::probe(board, known))
+            return known;
+    }
 
-    if (quiescence && !checked)
-        if (board_val >= beta)
-            return beta;
-        else if (alpha < board_val)
-            alpha = board_val;
+    if (depth >= 2 && (high_resolution_clock::now() >= config.deadline || instance.halt_search ||
+        (config.node_limit && instance.nodes_examined >= config.node_limit))) {
+        // The board goes back to the root, which may be searched again afterwards
+        for (; board.appended_moves > 0; board.appended_moves--)
+            board.unmake_move();
 
-    bits bm[64];
+        throw out_of_time_exception();
+    }
 
-    bool quiet = 
-        (depth > 0 && !quiescence) || !checked && !board.generate_moves(side, bm, false, true, board.side_sets[side ^ 1]);
+    if (depth <= 0)
+        return quiescence_search(board, alpha, beta, config);
 
-    if (depth <= 0) {
-        // Perform quiescence search
-        if (!quiescence && !quiet)
-            return timed_negamax_search(parallel, board, 12, alpha, beta, nullptr,
-                search_config{ config.deadline, config.eval, config.depth + 12 },
-                true);
+    bool checked = board.in_check(side);
 
-        return board_val;
-    }
+    chessmove tt_move = tt_entry.move();
+    bool has_tt_move = tt_entry.has_move() && legal_tt_move(board, side, tt_move);
 
-    if (quiescence && quiet)
-        return board_val;
+    bits bm[64];
 
     int phase = evaluation::game_phase_score(board);
 
     // Null move pruning
-    if (!quiescence &&
+    if (instance.features.null_move &&
         phase < 14 &&
         depth >= 2 &&
         !checked &&
-        !move &&
+        probe &&
         board.appended_moves > config.depth / 4) {
+        search_stats::add(search_stats::null_moves);
+        local_history().path[board.appended_moves] = 0;
         board.make_move(0, 0, 0, 0);
         board.appended_moves++;
-        bool fail_high = -timed_negamax_search(false, board, depth - 3, -beta, -beta + 1, move, config, quiescence) >= beta;
+        bool fail_high = -timed_negamax_search(false, board, depth - 3, -beta, -beta + 1, move, config) >= beta;
         board.unmake_move();
         board.appended_moves--;
 
-        if (fail_high)
+        if (fail_high) {
+            search_stats::add(search_stats::null_move_cutoffs);
             return beta;
+        }
+    }
+
+    // Internal iterative reduction, without a stored move the ordering below is
+    // mostly guesswork, so a shallower search costs little in accuracy
+    if (instance.features.internal_reductions && probe && !has_tt_move && depth >= iir_depth)
+        depth--;
+
+    int extension = 0;
+
+    // Singular extension, when every other move falls clearly short of the stored
+    // lower bound the TT move is the only good one and gets searched a ply deeper
+    if (instance.features.singular_extensions && has_tt_move && probe &&
+        depth >= singular_depth && tt_entry.depth >= depth - 3 &&
+        tt_entry.type != transposition_upper && std::abs(tt_entry.value) < INT_MAX - 256 &&
+        board.appended_moves < config.depth * 2) {
+        int singular_beta = tt_entry.value - singular_margin * depth;
+        int value = timed_negamax_search(false, board, (depth - 1) / 2,
+            singular_beta - 1, singular_beta, nullptr, config, &tt_move);
+
+        if (value < singular_beta)
+            extension = 1;
+        // Multi-cut, another move beats beta on its own
+        else if (singular_beta >= beta)
+            return singular_beta;
     }
 
     int ply = board.appended_moves + 1;
+    bool search_pv = true;
+
+    move_history &history = local_history();
+    int previous = ply >= 2 ? history.path[ply - 2] : 0;
+    int before_previous = ply >= 3 ? history.path[ply - 3] : 0;
+    int counter_move = previous ? history.counter_moves[previous] : 0;
+
+    // Quiet moves searched so far, their history drops if another move fails high
+    std::vector<chessmove> quiets;
+
+    // Moves searched before generating the rest
+    int searched = 0;
+
+    // The TT move first, a cutoff here saves generating and ordering the other moves
+    if (has_tt_move && !move) {
+        metrics::add(metrics::tt_move_searches);
+
+        rated_move first(0, tt_move);
+
+        if (is_quiet(board, tt_move))
+            quiets.push_back(tt_move);
+
+        int m = search_helper(first, true, 0,
+            board, depth + extension, alpha, beta, nullptr, config);
+
+        best_move = rated_move(m, tt_move);
+        searched = 1;
+
+        if (m > alpha) {
+            alpha = m;
+            search_pv = false;
+        }
+
+        if (alpha >= beta) {
+            metrics::add(metrics::beta_cutoffs);
+            metrics::add(metrics::first_move_cutoffs);
+            metrics::add(metrics::tt_move_cutoffs);
+            search_stats::add(search_stats::fail_highs);
+            search_stats::add(search_stats::first_move_fail_highs);
+
+            update_history(history, board, ply, depth, previous, before_previous, tt_move, quiets);
+
+            store_transposition(instance, z, best_move, depth, orig_alpha, beta);
+            return alpha;
+        }
+    }
+    // Checkmate for this side or a stalemate
+    else if (!board.any_moves(side))
+        return checked ? -INT_MAX + board.appended_moves : 0;
 
     // Move generation
     std::vector<rated_move> moves;
     moves.reserve(128);
 
     std::memset(bm, 0, sizeof bm);
-    board.generate_moves(side, bm, false, false, quiescence && !checked ? board.side_sets[side ^ 1] : ~0ull);
+    board.generate_moves(side, bm);
 
     for (int i = 0; i < 64; i++) {
         if (bits mask = bm[i]) {
             unsigned long ind;
 
-            static const int piece_values[7] = { 0, 0, 1025, 365, 337, 477, 82 };
-
             while (mask) {
                 _BitScanForward64(&ind, mask);
 
@@ -264,7 +735,18 @@ int timed_negamax_search(bool parallel,
 
                 char x = i & 7, y = i >> 3;
                 char dx = ind & 7, dy = ind >> 3;
+
+                chessmove candidate{ x, y, dx, dy };
+
+                if ((move && std::any_of(config.excluded.begin(), config.excluded.end(),
+                    [&](const chessmove &m) { return same_move(m, candidate); })) ||
+                    (searched && same_move(tt_move, candidate)) ||
+                    (excluded_move && same_move(*excluded_move, candidate))) {
+                    mask &= mask - 1;
+                    continue;
+                }
                 int pre_count = board.count_pieces();
+                int quiet_order = captured ? 0 : quiet_score(history, board, candidate, previous, before_previous);
 
                 board.make_move(x, y, dx, dy);
 
@@ -275,8 +757,8 @@ int timed_negamax_search(bool parallel,
 
                 size_t hash = board.hash;
                 {
-                    std::lock_guard<spinlock> guard(transposition_table_lock);
-                    auto t = transpositions[hash];
+                    std::lock_guard<spinlock> guard(instance.transposition_table_lock);
+                    auto t = instance.transposition(hash);
 
                     // If we've already seen this position before,
                     // use its estimated value for move ordering
@@ -292,20 +774,20 @@ int timed_negamax_search(bool parallel,
                         order_val = diff + (diff >= 0 ? 100000 : 40000);
                     }
                     else {
-                        if (ply >= 2 && !quiescence) {
-                            std::lock_guard<spinlock> guard(killer_lock);
-                            for (const chessmove &killer : killer_moves[ply])
-                                if (killer.org_x == x && killer.org_y == y &&
-                                    killer.dest_x == dx && killer.dest_y == dy)
-                                    order_val = 50000, ordered = true;
-                        }
+                        int code = move_code(candidate);
+
+                        if (ply >= 2 && (code == history.killers[ply][0] || code == history.killers[ply][1]))
+                            order_val = 50000, ordered = true;
+                        else if (code == counter_move)
+                            order_val = 45000, ordered = true;
 
+                        // History orders the quiet moves, only those it knows nothing about are evaluated
                         if (!ordered)
-                            order_val = config.eval(board, side);
+                            order_val = quiet_order ? quiet_order / 2 : config.eval(board, side);
                     }
                 }
 
-                moves.push_back(rated_move(order_val, chessmove{ x, y, 0, dx, dy }));
+                moves.push_back(rated_move(order_val, chessmove{ x, y, dx, dy }));
 
                 board.unmake_move();
 
@@ -314,7 +796,7 @@ int timed_negamax_search(bool parallel,
         }
     }
 
-    if (moves.size())
+    if (moves.size() && !searched)
         best_move = rated_move(-INT_MAX, moves[0].move);
 
     // Insertion sort
@@ -329,78 +811,59 @@ int timed_negamax_search(bool parallel,
         }
     }
 
-    bool search_pv = true;
-
-    std::vector<chessboard> par_boards;
-    std::vector<rated_move> par_moves;
-    std::vector<int> par_outputs;
-    std::vector<delayed_exception> exceptions;
-
-    if (parallel) {
-        par_boards = std::vector<chessboard>(processor_count);
-        par_moves = std::vector<rated_move>(processor_count);
-        par_outputs = std::vector<int>(processor_count);
-        exceptions = std::vector<delayed_exception>(processor_count);
-    }
+    // The first move is searched alone for a bound, then the others are handed out
+    // one by one, so a big subtree doesn't keep the rest of the threads waiting
+    bool shared = parallel && !searched && moves.size() > 2;
 
     for (int i = 0; i < moves.size(); i++) {
-        if (parallel) {
-            int cores = std::min(processor_count, int(moves.size() - i));
-
-#pragma omp parallel for shared(par_boards, par_moves, par_outputs, exceptions)
-            for (int j = 0; j < cores; j++) {
-                par_moves[j] = moves[i + j];
-                chessboard &b = par_boards[j] = board;
-
-                exceptions[j].run([&]() mutable {
-                    par_outputs[j] = search_helper(
-                        par_moves[j], search_pv, i + j,
-                        b, depth, alpha, beta, nullptr, config, quiescence);
-                    }
-                );
+        if (shared && i == 1) {
+            size_t count = moves.size() - i;
+            std::vector<int> outputs(count), bounds(count);
+            std::atomic<int> shared_alpha = alpha;
+            task_group group(instance.workers());
+
+            for (size_t j = 0; j < count; j++) {
+                group.run([&, j] {
+                    chessboard b = board;
+                    rated_move m = moves[i + j];
+                    int a = bounds[j] = shared_alpha;
+                    int value = outputs[j] = search_helper(m, false, int(i + j),
+                        b, depth, a, beta, nullptr, config);
+
+                    for (int current = shared_alpha; value > current &&
+                        !shared_alpha.compare_exchange_weak(current, value);) {}
+                });
             }
 
-            bool cutoff = false;
-
-            for (int j = 0; j < cores; j++) {
-                exceptions[j].rethrow();
+            group.wait();
 
-                int m = par_outputs[j];
+            for (size_t j = 0; j < count; j++) {
+                if (is_quiet(board, moves[i + j].move))
+                    quiets.push_back(moves[i + j].move);
 
-                if (m > best_move.value) {
-                    best_move.value = m;
-                    best_move.move = par_moves[j].move;
+                // Failing low against a bound raised by another move only says this one isn't better
+                if (outputs[j] > bounds[j] && outputs[j] > best_move.value) {
+                    best_move.value = outputs[j];
+                    best_move.move = moves[i + j].move;
                 }
+            }
 
-                if (best_move.value > alpha) {
-                    alpha = best_move.value;
-                    search_pv = false;
-                }
-
-                if (alpha >= beta) {
-                    cutoff = true;
-
-                    if (ply >= 2) {
-                        std::lock_guard<spinlock> guard(killer_lock);
-
-                        if (killer_moves[ply].size() >= 2)
-                            killer_moves[ply].pop_back();
-
-                        killer_moves[ply].push_back(best_move.move);
-                    }
+            alpha = std::max(alpha, best_move.value);
 
-                    break;
-                }
+            if (alpha >= beta) {
+                metrics::add(metrics::beta_cutoffs);
+                search_stats::add(search_stats::fail_highs);
+                update_history(history, board, ply, depth, previous, before_previous, best_move.move, quiets);
             }
 
-            if (cutoff)
-                break;
-
-            i += cores - 1;
+            break;
         }
         else {
-            int m = search_helper(moves[i], search_pv, i,
-                board, depth, alpha, beta, nullptr, config, quiescence);
+            if (is_quiet(board, moves[i].move))
+                quiets.push_back(moves[i].move);
+
+            int m = search_helper(moves[i], search_pv, i + searched,
+                board, depth, alpha, beta, nullptr, config);
 
             if (m > best_move.value) {
                 best_move.value = m;
@@ -413,32 +876,24 @@ int timed_negamax_search(bool parallel,
             }
 
             if (alpha >= beta) {
-                std::lock_guard<spinlock> guard(killer_lock);
+                metrics::add(metrics::beta_cutoffs);
+                search_stats::add(search_stats::fail_highs);
 
-                if (ply >= 2) {
-                    if (killer_moves[ply].size() >= 2)
-                        killer_moves[ply].pop_back();
-
-                    killer_moves[ply].push_back(best_move.move);
+                if (i + searched == 0) {
+                    metrics::add(metrics::first_move_cutoffs);
+                    search_stats::add(search_stats::first_move_fail_highs);
                 }
+
+                update_history(history, board, ply, depth, previous, before_previous, best_move.move, quiets);
+
                 break;
             }
         }
     }
 
-    if (!quiescence) {
-        auto e = transposition_entry(z, best_move.value, depth, 0);
-
-        if (best_move.value <= orig_alpha)
-            e.type = transposition_upper;
-        else if (best_move.value >= beta)
-            e.type = transposition_lower;
-        else
-            e.type = transposition_exact;
-
-        std::lock_guard<spinlock> guard(transposition_table_lock);
-        transpositions[z] = e;
-    }
+    // With moves left out the value isn't the position's value
+    if (!excluded_move && (!move || config.excluded.empty()))
+        store_transposition(instance, z, best_move, depth, orig_alpha, beta);
 
     if (move)
         *move = best_move;
@@ -448,40 +903,305 @@ int timed_negamax_search(bool parallel,
 
 namespace engine
 {
-    bool iterative_deepening_negamax(chessboard& board, rated_move &result,
-        int max_search_depth, int max_search_time, eval_func eval, int min_depth, int retries)
+    void stop()
+    {
+        stop(default_instance);
+    }
+
+    void stop(instance &engine)
+    {
+        engine.halt_search = true;
+    }
+
+    std::shared_ptr<instance> make_instance(size_t megabytes, int threads, const search_features &enabled)
     {
-        while (killer_moves.size() < max_search_depth + 256)
-            killer_moves.push_back(std::vector<chessmove>());
+        auto engine = std::make_shared<instance>();
+        engine->processor_count = std::max(threads, 1);
+        engine->features = enabled;
+        engine->transpositions = allocate_transpositions(table_entries(megabytes), engine->processor_count);
+        return engine;
+    }
+
+    void set_hash_size(size_t megabytes)
+    {
+        auto &transpositions = default_instance.transpositions;
+
+        transpositions = transposition_table();
+        transpositions = allocate_transpositions(table_entries(megabytes), default_instance.processor_count);
+    }
 
-        halt_search = false;
+    bool map_hash_file(const std::string &path, size_t megabytes, bool *warm)
+    {
+        size_t entries = table_entries(megabytes);
+        auto file = std::make_shared<mapped_file>();
+
+        auto &transpositions = default_instance.transpositions;
+
+        // Drop the old table first, both may not fit in memory at once
+        transpositions = transposition_table();
+
+        if (!file->open_writable(path, transposition_file_offset + entries * sizeof(transposition_entry)))
+            return false;
+
+        auto &header = *(transposition_file_header *)file->data();
+
+        transposition_table t;
+        t.entries = (transposition_entry *)(file->data() + transposition_file_offset);
+        t.mask = entries - 1;
+        t.memory = file;
+        t.file = file.get();
+
+        // Entries of another layout or with other Zobrist keys would be garbage
+        bool valid =
+            !std::memcmp(header.magic, transposition_file_magic, sizeof header.magic) &&
+            header.version == transposition_file_version &&
+            header.entry_size == sizeof(transposition_entry) &&
+            header.entries == entries &&
+            header.zobrist_seed == zobrist_seed &&
+            header.zobrist_fingerprint == zobrist_fingerprint();
+
+        if (!valid) {
+            clear_transpositions(t, default_instance.processor_count);
+            std::memcpy(header.magic, transposition_file_magic, sizeof header.magic);
+            header.version = transposition_file_version;
+            header.entry_size = sizeof(transposition_entry);
+            header.entries = entries;
+            header.zobrist_seed = zobrist_seed;
+            header.zobrist_fingerprint = zobrist_fingerprint();
+        }
+
+        if (warm)
+            *warm = valid;
+
+        transpositions = t;
+        return true;
+    }
+
+    bool flush_hash_file()
+    {
+        // Heap tables have nothing to write back. Entries written during the flush
+        // may be torn in the file, their hash check makes probes skip most of those
+        auto &transpositions = default_instance.transpositions;
+        return transpositions.file && transpositions.file->flush();
+    }
+
+    void set_features(const search_features &enabled)
+    {
+        default_instance.features = enabled;
+    }
+
+    void set_threads(int count)
+    {
+        default_instance.processor_count = std::max(count, 1);
+    }
+
+    task_scheduler &workers()
+    {
+        return default_instance.workers();
+    }
+
+    void set_memory_policy(numa_policy policy, int node)
+    {
+        memory_policy = policy;
+        memory_node = node;
+    }
+
+    void set_interactive(bool interactive)
+    {
+        interactive_search = interactive;
+    }
+
+    void clear()
+    {
+        clear(default_instance);
+    }
+
+    void clear(instance &engine)
+    {
+        clear_transpositions(engine.transpositions, engine.processor_count);
+        history_generation++;
+    }
+
+    bool iterative_deepening_negamax(chessboard &board, rated_move &result,
+        int max_search_depth, int max_search_time, eval_func eval, int min_depth, int retries, int *reached_depth,
+        const progress_func &progress)
+    {
+        search_limits limits;
+        limits.depth = max_search_depth;
+        limits.movetime = max_search_time * 1000;
+
+        return iterative_deepening_negamax(default_instance, board, result, limits, eval, reached_depth, progress);
+    }
+
+    // Weaker levels accept bigger losses against the best line, by a random amount
+    const rated_move &pick_by_skill(const std::vector<rated_move> &lines, int skill, std::mt19937_64 &rng)
+    {
+        long long weakness = 120 - 2 * skill;
+        long long top = lines[0].value;
+        long long delta = std::min(top - lines.back().value, (long long)piece_values[pawn]);
+        long long best = LLONG_MIN;
+        size_t chosen = 0;
+
+        for (size_t i = 0; i < lines.size(); i++) {
+            long long push = (weakness * (top - lines[i].value) + delta * (long long)(rng() % weakness)) / 128;
+
+            if (lines[i].value + push > best) {
+                best = lines[i].value + push;
+                chosen = i;
+            }
+        }
+
+        return lines[chosen];
+    }
+
+    bool iterative_deepening_negamax(chessboard &board, rated_move &result, const search_limits &limits,
+        eval_func eval, int *reached_depth, const progress_func &progress, std::vector<rated_move> *lines)
+    {
+        return iterative_deepening_negamax(default_instance, board, result, limits, eval, reached_depth, progress, lines);
+    }
+
+    bool iterative_deepening_negamax(instance &engine, chessboard &board, rated_move &result,
+        const search_limits &limits, eval_func eval, int *reached_depth, const progress_func &progress,
+        std::vector<rated_move> *lines)
+    {
+        int completed = 0;
+        int max_search_depth = limits.depth;
+        int multipv = std::max(limits.multipv, 1);
+        bool weakened = limits.skill < max_skill;
+
+        // Weak play comes from picking worse moves, searching deep for it would be wasted
+        if (weakened) {
+            multipv = std::max(multipv, skill_candidates);
+            max_search_depth = std::min(max_search_depth, 2 + std::max(limits.skill, 0) / 2);
+        }
+
+        std::vector<rated_move> best_lines;
+
+        // Nothing left over from earlier searches may influence this one
+        if (limits.deterministic) {
+            auto &t = engine.deterministic_transpositions;
+
+            if (!t.entries)
+                t = allocate_transpositions(table_entries(deterministic_hash_size), engine.processor_count);
+            else
+                clear_transpositions(t, engine.processor_count);
+
+            std::swap(engine.transpositions, t);
+            history_generation++;
+        }
+
+        if (!engine.transpositions.entries)
+            engine.transpositions = allocate_transpositions(default_transpositions_size, engine.processor_count);
+
+        // Perfect play straight from the tablebases
+        int wdl;
+
+        if (engine.features.tablebases && board.count_pieces() <= size_t(tablebase::max_pieces()) &&
+            tablebase::probe_root(board, result.move, wdl)) {
+            result.value = tablebase::wdl_to_score(wdl, 0);
+
+            if (interactive_search)
+                logger::write(log_level::info, "tablebase_move", { { "wdl", wdl } });
+
+            if (reached_depth)
+                *reached_depth = max_search_depth;
+
+            if (limits.deterministic)
+                std::swap(engine.transpositions, engine.deterministic_transpositions);
+
+            return true;
+        }
+
+        engine.halt_search = false;
         g_total_nodes = 0;
 
-        std::thread waiter(wait_for_keypress);
+        std::thread waiter;
+
+        if (interactive_search && !limits.deterministic)
+            waiter = std::thread(wait_for_keypress, std::ref(engine));
 
         auto start = high_resolution_clock::now();
 
         // Iterative deepening
-        search_config config { high_resolution_clock::now() + seconds(max_search_time), eval, 1 };
+        search_config config;
+        config.eval = eval;
+        config.instance = &engine;
+
+        if (limits.movetime)
+            config.deadline = high_resolution_clock::now() + milliseconds(limits.movetime);
 
         int i = 1; // min_depth + retries;
         int total_nodes_examined = 0;
+        bool log_iterations = interactive_search && logger::sample(iteration_log_sample);
+
+        // Unlike total_nodes_examined this includes an interrupted iteration
+        long long searched_nodes = 0;
+        std::atomic<int> &nodes_examined = engine.nodes_examined;
+        nodes_examined = 0;
+
+        // Nodes of every completed iteration, for the statistics
+        std::vector<long long> iteration_nodes;
+        search_stats::reset();
 
         try {
             for (; i <= max_search_depth && high_resolution_clock::now() < config.deadline; i++) {
+                searched_nodes += nodes_examined;
                 nodes_examined = 0;
-                tt_found = 0;
+                engine.tt_found = 0;
+                engine.tb_hits = 0;
+
+                if (limits.nodes) {
+                    if (searched_nodes >= limits.nodes)
+                        break;
+
+                    config.node_limit = limits.nodes - searched_nodes;
+                }
+
+                // Every further line is the best of the root moves not reported yet
+                std::vector<rated_move> iteration_lines;
+                config.excluded.clear();
 
-                timed_negamax_search(true, board, i, -INT_MAX, INT_MAX, &result, config);
+                for (int k = 0; k < multipv; k++) {
+                    rated_move line;
 
-                auto ev = evaluation::to_string(result.value);
+                    // Splitting the root between threads makes the node order depend on timing
+                    timed_negamax_search(!limits.deterministic, board, i, -INT_MAX, INT_MAX, &line, config);
 
-                std::printf("%i/%i plies, %i/%i/%i nodes, score = %s\n",
-                    i, max_search_depth, g_total_nodes.load(), nodes_examined.load(), tt_found.load(), ev.c_str());
+                    if (line.move.empty())
+                        break;
 
+                    iteration_lines.push_back(line);
+                    config.excluded.push_back(line.move);
+                }
+
+                if (iteration_lines.empty())
+                    break;
+
+                best_lines = iteration_lines;
+                result = best_lines[0];
+
+                if (log_iterations) {
+                    logger::write(log_level::info, "iteration", {
+                        { "depth", i }, { "max_depth", max_search_depth },
+                        { "nodes", nodes_examined.load() }, { "tt_hits", engine.tt_found.load() },
+                        { "tb_hits", engine.tb_hits.load() }, { "score", evaluation::to_string(result.value) }
+                    });
+                }
+
+                if (progress)
+                    progress(i, best_lines, total_nodes_examined + nodes_examined);
+
+                if (search_stats::enabled)
+                    iteration_nodes.push_back(nodes_examined);
+
+                completed = i;
+
+                // A forced mate won't change with more depth
                 if (result.value >= INT_MAX  - 256 ||
-                    result.value <= -INT_MAX + 256)
+                    result.value <= -INT_MAX + 256) {
+                    completed = max_search_depth;
                     break;
+                }
 
                 total_nodes_examined += nodes_examined;
                 config.depth++;
@@ -490,15 +1210,45 @@ namespace engine
         catch (out_of_time_exception &e) {
         }        
 
-        waiter.detach();
+        if (waiter.joinable())
+            waiter.detach();
+
+        if (limits.deterministic)
+            std::swap(engine.transpositions, engine.deterministic_transpositions);
+
+        if (weakened && best_lines.size() > 1) {
+            // Deterministic searches have to pick the same way every time
+            std::mt19937_64 rng(limits.deterministic ? board.hash : std::random_device()());
+            result = pick_by_skill(best_lines, limits.skill, rng);
+        }
+
+        if (lines)
+            *lines = best_lines;
 
-        auto took = duration_cast<seconds>(high_resolution_clock::now() - start).count();
+        if (reached_depth)
+            *reached_depth = completed;
+
+        searched_nodes += nodes_examined;
+        double elapsed = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+
+        metrics::add(metrics::searches);
+        metrics::add(metrics::search_nodes, searched_nodes);
+        metrics::observe(metrics::search_depth, completed);
+
+        if (elapsed > 0)
+            metrics::observe(metrics::nodes_per_second, searched_nodes / elapsed);
+
+        search_stats::report(completed, elapsed, iteration_nodes);
 
         //if (retries && result.move.empty())
         //    return iterative_deepening_negamax(board, result, max_search_depth, max_search_time, eval, retries - 1);
 
-        if (took)
-            std::printf("\n%i nodes in %i seconds => %i n/s\n", total_nodes_examined, took, total_nodes_examined / took);
+        if (interactive_search) {
+            logger::write(log_level::info, "search", {
+                { "depth", completed }, { "nodes", searched_nodes }, { "seconds", elapsed },
+                { "nps", elapsed > 0 ? (long long)(searched_nodes / elapsed) : 0ll }
+            });
+        }
 
         return !result.move.empty();
     }
@@ -1,6 +1,8 @@
 #pragma once
 #include "chess.hh"
 #include "eval.hh"
+#include "large_pages.hh"
+#include "task_scheduler.hh"
 
 struct rated_move {
     int value;
@@ -11,9 +13,93 @@ struct rated_move {
     inline rated_move() : value(-INT_MAX), move(chessmove()) {}
 };
 
+// Search techniques that can be switched off to measure what they're worth
+struct search_features {
+    bool null_move = true;
+    bool late_move_reductions = true;
+    bool delta_pruning = true;
+    bool see_pruning = true;
+    bool tablebases = true;
+    bool singular_extensions = true;
+    bool internal_reductions = true;
+};
+
+constexpr int max_multipv = 64;
+constexpr int max_skill = 20;
+
+struct search_limits {
+    int depth = 64;
+
+    // Milliseconds, 0 for no limit
+    int movetime = 10000;
+
+    // 0 for no limit
+    long long nodes = 0;
+
+    // One thread and fresh tables, so equal input always gives the same move
+    bool deterministic = false;
+
+    // Number of best root moves to find, each with its own score
+    int multipv = 1;
+
+    // Below max_skill the move is picked among the best few with a shallow search
+    int skill = max_skill;
+};
+
 namespace engine
 {
+    // Reports the best lines after every completed depth
+    using progress_func = std::function<void(int depth, const std::vector<rated_move> &lines, long long nodes)>;
+
     bool iterative_deepening_negamax(chessboard &board, rated_move &result,
         int max_search_depth = 64, int max_search_time = 10, eval_func eval = evaluation::simplified,
-        int min_depth = 4, int retries = 3);
+        int min_depth = 4, int retries = 3, int *reached_depth = nullptr,
+        const progress_func &progress = nullptr);
+
+    bool iterative_deepening_negamax(chessboard &board, rated_move &result, const search_limits &limits,
+        eval_func eval = evaluation::simplified, int *reached_depth = nullptr,
+        const progress_func &progress = nullptr, std::vector<rated_move> *lines = nullptr);
+
+    // Aborts the running search, the last completed depth is kept
+    void stop();
+
+    void set_hash_size(size_t megabytes);
+
+    // Keeps the transposition table in a file mapping so that it survives restarts.
+    // Entries from an earlier run are reused if the file has the same size, entry
+    // layout and Zobrist keys, warm tells whether they were
+    bool map_hash_file(const std::string &path, size_t megabytes, bool *warm = nullptr);
+
+    // Snapshots the mapped table to disk, the entries are never copied
+    bool flush_hash_file();
+
+    void set_threads(int count);
+
+    // Work-stealing pool with as many threads as set_threads asked for, the
+    // search's own and for other jobs while no search runs
+    task_scheduler &workers();
+
+    // Placement of tables allocated from now on, interleaving suits one table
+    // shared by threads on several sockets
+    void set_memory_policy(numa_policy policy, int node = 0);
+    void set_features(const search_features &enabled);
+
+    // Interactive searches print their progress and stop on a key press
+    void set_interactive(bool interactive);
+
+    // Forgets transpositions and move ordering history between games
+    void clear();
+
+    // A transposition table, stop flag, node counters, features and worker threads
+    // of its own. The functions above act on one shared instance, searches that run
+    // side by side in one process, like the games of a match, each take their own
+    struct instance;
+    std::shared_ptr<instance> make_instance(size_t megabytes, int threads, const search_features &enabled = {});
+
+    bool iterative_deepening_negamax(instance &engine, chessboard &board, rated_move &result,
+        const search_limits &limits, eval_func eval = evaluation::simplified, int *reached_depth = nullptr,
+        const progress_func &progress = nullptr, std::vector<rated_move> *lines = nullptr);
+
+    void stop(instance &engine);
+    void clear(instance &engine);
 }
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include "search_stats.hh"
+
+#ifdef SEARCH_STATISTICS
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+// Written by its thread during a search and by reset and report in between,
+// the task joins of the search order the two
+struct stats_block {
+    unsigned long long counters[search_stats::counter_count];
+    unsigned long long nodes[search_stats::max_ply], qnodes[search_stats::max_ply];
+};
+
+std::mutex blocks_lock;
+
+// Blocks outlive their threads like the metrics shards do
+std::vector<std::unique_ptr<stats_block>> blocks;
+
+stats_block &local_block() {
+    thread_local stats_block *block = [] {
+        auto b = std::make_unique<stats_block>();
+        std::lock_guard<std::mutex> lock(blocks_lock);
+        blocks.push_back(std::move(b));
+        return blocks.back().get();
+    }();
+
+    return *block;
+}
+
+void search_stats::add(counter_id id) {
+    local_block().counters[id]++;
+}
+
+void search_stats::node(int ply) {
+    local_block().nodes[std::min(ply, max_ply - 1)]++;
+}
+
+void search_stats::qnode(int ply) {
+    local_block().qnodes[std::min(ply, max_ply - 1)]++;
+}
+
+void search_stats::reset() {
+    std::lock_guard<std::mutex> lock(blocks_lock);
+
+    for (auto &block : blocks)
+        *block = stats_block();
+}
+
+inline double rate(unsigned long long part, unsigned long long whole) {
+    return whole ? double(part) / whole : 0;
+}
+
+// Per ply counts up to the deepest ply reached
+void write_plies(std::ostringstream &json, const unsigned long long *counts) {
+    int plies = search_stats::max_ply;
+
+    while (plies > 0 && !counts[plies - 1])
+        plies--;
+
+    json << '[';
+
+    for (int i = 0; i < plies; i++)
+        json << (i ? "," : "") << counts[i];
+
+    json << ']';
+}
+
+void search_stats::report(int depth, double seconds, const std::vector<long long> &iteration_nodes) {
+    stats_block total = stats_block();
+
+    {
+        std::lock_guard<std::mutex> lock(blocks_lock);
+
+        for (auto &block : blocks) {
+            for (int i = 0; i < counter_count; i++)
+                total.counters[i] += block->counters[i];
+
+            for (int i = 0; i < max_ply; i++) {
+                total.nodes[i] += block->nodes[i];
+                total.qnodes[i] += block->qnodes[i];
+            }
+        }
+    }
+
+    unsigned long long nodes = 0, qnodes = 0;
+
+    for (int i = 0; i < max_ply; i++) {
+        nodes += total.nodes[i];
+        qnodes += total.qnodes[i];
+    }
+
+    const unsigned long long *c = total.counters;
+    std::ostringstream json;
+
+    json << "{\"depth\":" << depth << ",\"seconds\":" << seconds <<
+        ",\"nodes\":" << nodes << ",\"qnodes\":" << qnodes << ",\"nodes_by_ply\":";
+    write_plies(json, total.nodes);
+    json << ",\"qnodes_by_ply\":";
+    write_plies(json, total.qnodes);
+
+    json <<
+        ",\"fail_highs\":" << c[fail_highs] <<
+        ",\"first_move_cutoff_rate\":" << rate(c[first_move_fail_highs], c[fail_highs]) <<
+        ",\"null_moves\":" << c[null_moves] <<
+        ",\"null_move_cutoff_rate\":" << rate(c[null_move_cutoffs], c[null_moves]) <<
+        ",\"reduced_searches\":" << c[reduced_searches] <<
+        ",\"lmr_research_rate\":" << rate(c[re_searches], c[reduced_searches]) <<
+        ",\"tt_probes\":" << c[tt_probes] <<
+        ",\"tt_hit_rate\":" << rate(c[tt_hits], c[tt_probes]) <<
+        ",\"tt_cutoff_rate\":" << rate(c[tt_cutoffs], c[tt_probes]) <<
+        ",\"tt_collision_rate\":" << rate(c[tt_collisions], c[tt_probes]);
+
+    // Nodes of each completed iteration, the last two give the effective branching factor
+    json << ",\"iteration_nodes\":[";
+
+    for (size_t i = 0; i < iteration_nodes.size(); i++)
+        json << (i ? "," : "") << iteration_nodes[i];
+
+    size_t n = iteration_nodes.size();
+
+    json << "],\"branching_factor\":" <<
+        (n >= 2 ? rate(iteration_nodes[n - 1], iteration_nodes[n - 2]) : 0) << "}";
+
+    std::fprintf(stderr, "%s\n", json.str().c_str());
+}
+#endif
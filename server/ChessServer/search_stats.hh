@@ -0,0 +1,41 @@
+#pragma once
+#include <vector>
+
+// Where the nodes of a search went, for comparing search changes. Only built in
+// with SEARCH_STATISTICS defined, otherwise every call below compiles to nothing.
+// Each thread counts into its own block of plain integers, the blocks are summed
+// up once the search is over and written to stderr as one JSON line per search
+namespace search_stats
+{
+    enum counter_id {
+        tt_probes, tt_hits, tt_cutoffs, tt_collisions,
+        fail_highs, first_move_fail_highs,
+        null_moves, null_move_cutoffs,
+        reduced_searches, re_searches,
+        counter_count
+    };
+
+    // Nodes further from the root are counted with the deepest ply
+    constexpr int max_ply = 64;
+
+#ifdef SEARCH_STATISTICS
+    constexpr bool enabled = true;
+
+    void add(counter_id id);
+    void node(int ply);
+    void qnode(int ply);
+
+    // Only between searches, while no search thread is counting
+    void reset();
+    void report(int depth, double seconds, const std::vector<long long> &iteration_nodes);
+#else
+    constexpr bool enabled = false;
+
+    inline void add(counter_id) {}
+    inline void node(int) {}
+    inline void qnode(int) {}
+
+    inline void reset() {}
+    inline void report(int, double, const std::vector<long long> &) {}
+#endif
+}
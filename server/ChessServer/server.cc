@@ -1,172 +1,566 @@
 #include "chess.hh"
 #include "search.hh"
+#include "book.hh"
+#include "tablebase.hh"
+#include "bitbase.hh"
+#include "result_cache.hh"
+#include "assets.hh"
+#include "protocol.hh"
+#include "metrics.hh"
+#include "logger.hh"
+#include "async.hh"
 #include <unordered_map>
 #include <algorithm>
 #include <restbed>
 #include <fstream>
+#include <csignal>
+#include <future>
 
 const std::string root_dir = "D:/chess";
 const char *file_paths[] = { "/", "/index.html", "/index.css", "/app.js", "/pieces.png" };
 
+const std::string book_path = root_dir + "/book.bin";
+const std::string book_keys_path = root_dir + "/polyglot_keys.txt";
+constexpr int book_max_ply = 20;
+
+const std::string tablebase_path = root_dir + "/syzygy";
+constexpr int tablebase_max_pieces = 6;
+
+constexpr size_t max_batch_positions = 4096;
+
+// Handlers only parse and write while searches run elsewhere, so a couple of
+// I/O threads hold every open connection
+constexpr unsigned io_threads = 2;
+
+// A search that waited this many seconds for the engine is answered with 503
+constexpr double engine_queue_timeout = 20;
+
+constexpr log_level log_threshold = log_level::info;
+
+const std::string result_cache_path = root_dir + "/result_cache.bin";
+constexpr size_t result_cache_size = 1 << 16;
+constexpr bool persist_result_cache = true;
+
+// Mapped from disk so that a restart doesn't start from an empty table. The file
+// mapping takes neither huge pages nor the NUMA policy below, those only apply
+// with persist_transpositions = false or when the file can't be mapped
+const std::string transposition_path = root_dir + "/transpositions.bin";
+constexpr size_t transposition_megabytes = 3072;
+constexpr bool persist_transpositions = true;
+
+// Every search thread probes the whole table, so no socket should hold all of it
+constexpr numa_policy transposition_numa_policy = numa_policy::interleave;
+
 using namespace restbed;
+using namespace std::chrono;
+
+// Continues handlers on restbed's own I/O threads
+class service_executor : public executor {
+public:
+    explicit service_executor(Service &service) : service(service) {}
+    inline void post(std::function<void()> work) override { service.schedule(std::move(work)); }
+
+private:
+    Service &service;
+};
+
+// Set with -mock-search <ms> for load tests. Every search then spins for that
+// long and plays a legal move, so the numbers show the service and not the engine
+int mock_search_cost = -1;
+
+// Handlers resume on the first. Searches share the transposition table and the
+// stop flag, so the second runs them one at a time
+executor *io_executor = nullptr;
+executor *engine_executor = nullptr;
+
+// Set on shutdown, engine jobs that haven't started by then are dropped
+std::atomic<bool> engine_closed = false;
+
+inline double seconds_since(steady_clock::time_point start) {
+    return duration_cast<duration<double>>(steady_clock::now() - start).count();
+}
+
+// The board in the legacy request format, one hex digit per square
+std::string board_digits(const chessboard &board)
+{
+    std::string digits(64, '0');
+
+    for (int i = 0; i < 64; i++)
+        digits[i] = "0123456789abcdef"[board.pieces[i] & 15];
 
-inline int digit_hex_to_int(char x) {
-    return x >= 'a' ? x - 'a' + 10 : x - '0';
+    return digits;
+}
+
+search_limits request_limits(const game_request &game)
+{
+    search_limits limits;
+    limits.depth = game.max_depth;
+    limits.movetime = game.movetime ? game.movetime : game.max_time * 1000;
+    limits.nodes = game.max_nodes;
+    limits.deterministic = game.deterministic;
+    limits.multipv = game.multipv;
+    limits.skill = game.skill;
+
+    // A clock would make the result depend on the load, but without
+    // a node limit it's the only thing bounding the search
+    if (game.deterministic && game.max_nodes)
+        limits.movetime = 0;
+
+    return limits;
+}
+
+// Different positions can share a hash, so a cached move may not apply
+bool is_legal(chessboard &board, const chessmove &m)
+{
+    bits legal_moves[64] = { 0 };
+    board.generate_moves(board.side_to_move, legal_moves);
+    return legal_moves[m.org_x + m.org_y * 8] >> (m.dest_x + m.dest_y * 8) & 1;
+}
+
+// Stands in for the engine in mock mode
+void mock_search(chessboard &board, rated_move &response)
+{
+    auto deadline = steady_clock::now() + milliseconds(mock_search_cost);
+
+    while (steady_clock::now() < deadline) {}
+
+    bits legal_moves[64] = { 0 };
+    board.generate_moves(board.side_to_move, legal_moves);
+
+    int count = 0;
+
+    for (int i = 0; i < 64; i++)
+        count += int(__popcnt64(legal_moves[i]));
+
+    // Spread over the moves so that self-played games don't all go the same way
+    int pick = count ? int(board.hash % count) : 0;
+
+    for (int i = 0; i < 64; i++)
+        for (bits targets = legal_moves[i]; targets; targets &= targets - 1, pick--)
+            if (!pick) {
+                unsigned long j;
+                _BitScanForward64(&j, targets);
+                response = rated_move(0, chessmove{ i % 8, i / 8, int(j % 8), int(j / 8) });
+                return;
+            }
+}
+
+// Every search of the service runs through here
+void run_search(chessboard &board, rated_move &response, const search_limits &limits, int *reached_depth,
+    const engine::progress_func &progress, std::vector<rated_move> *lines)
+{
+    if (mock_search_cost < 0) {
+        engine::iterative_deepening_negamax(board, response, limits, evaluation::pesto, reached_depth, progress, lines);
+        return;
+    }
+
+    mock_search(board, response);
+    *reached_depth = 1;
+
+    if (progress)
+        progress(1, { response }, 1);
+}
+
+// co_await fetch_body{ session, length } suspends until the body has arrived
+struct fetch_body {
+    std::shared_ptr<Session> session;
+    size_t length;
+    Bytes body;
+
+    inline bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> coroutine) {
+        session->fetch(length, [this, coroutine](const std::shared_ptr<Session>, const Bytes &data) {
+            body = data;
+            coroutine.resume();
+        });
+    }
+
+    inline Bytes await_resume() { return std::move(body); }
+};
+
+// co_await written{ write } hands write the callback that continues the coroutine,
+// so it resumes once restbed is done with the data
+struct written {
+    std::function<void(std::function<void(const std::shared_ptr<Session>)>)> write;
+
+    inline bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> coroutine) {
+        write([coroutine](const std::shared_ptr<Session>) { coroutine.resume(); });
+    }
+
+    inline void await_resume() const noexcept {}
+};
+
+// co_await on_engine(work) runs work on the engine and continues on the I/O threads
+// with its result, or with nothing when the job sat in the queue past engine_queue_timeout
+template<class F> auto on_engine(F work)
+{
+    using result_type = std::optional<std::invoke_result_t<F &>>;
+    auto queued = steady_clock::now();
+
+    return run_on(*engine_executor, *io_executor, [work = std::move(work), queued]() mutable -> result_type {
+        double waited = seconds_since(queued);
+        metrics::observe(metrics::queue_wait, waited);
+
+        // The client has most likely given up on this one
+        if (waited > engine_queue_timeout || engine_closed)
+            return std::nullopt;
+
+        struct active_search {
+            active_search() { metrics::active_searches++; }
+            ~active_search() { metrics::active_searches--; }
+        } active;
+
+        return work();
+    });
+}
+
+// The whole response at once, then the connection is closed
+void reply(const std::shared_ptr<Session> &session, int code, const std::string &data)
+{
+    session->close(code, data, {
+        { "Content-Length", std::to_string(data.length()) },
+        { "Connection", "close" },
+        { "Access-Control-Allow-Origin", "*" }
+    });
 }
 
 void process_file(const std::shared_ptr<Session> session)
 {
     const auto request = session->get_request();
+    auto cache = assets::snapshot();
+    auto it = cache->find(request->get_path());
 
-    size_t content_length = request->get_header("Content-Length", 0);
+    if (it == cache->end()) {
+        session->close(NOT_FOUND, "", { { "Content-Length", "0" }, { "Connection", "close" } });
+        return;
+    }
 
-    session->fetch(content_length, [request](const std::shared_ptr<Session> session, const Bytes &body)
-    {
-        auto bye = [session](int code, const restbed::Bytes& data) {
-            session->close(code, data, {
-                { "Content-Length", std::to_string(data.size()) },
-                { "Connection", "close" },
-                { "Access-Control-Allow-Origin", "*" }
-            });
-        };
+    const static_asset &asset = it->second;
 
-        std::string path = request->get_path();
+    const char *encoding;
+    const Bytes &data = assets::select(asset, request->get_header("Accept-Encoding", std::string()), encoding);
+    std::string etag = assets::etag(asset, encoding);
 
-        if (path == "/")
-            path += "index.html";
+    std::multimap<std::string, std::string> headers {
+        { "ETag", etag },
+        { "Cache-Control", asset.cache_control },
+        { "Vary", "Accept-Encoding" },
+        { "Connection", "keep-alive" },
+        { "Access-Control-Allow-Origin", "*" }
+    };
 
-        std::string s = root_dir + path;
-        std::ifstream is(s, std::ios::binary);
-        restbed::Bytes file(std::istreambuf_iterator<char>(is), { });
+    // The client already has this exact version
+    std::string if_none_match = request->get_header("If-None-Match", std::string());
 
-        bye(OK, file);
-    });
+    if (if_none_match == "*" || if_none_match.find(etag) != std::string::npos) {
+        session->yield(NOT_MODIFIED, Bytes(), headers);
+        return;
+    }
+
+    headers.insert({ "Content-Length", std::to_string(data.size()) });
+    headers.insert({ "Content-Type", asset.content_type });
+
+    if (encoding)
+        headers.insert({ "Content-Encoding", encoding });
+
+    session->yield(OK, data, headers);
+}
+
+// What handle_move keeps of a request while it waits for the engine
+struct move_request {
+    game_request game;
+    size_t hash = 0, history_key = 0;
+
+    // The book and the cache only know a single full strength move
+    bool single_line = false;
 };
 
-void process_move(const std::shared_ptr<Session> session)
+// Logs the move and formats the reply, with the position the move is played in on the board
+std::string move_reply(const chessboard &board, const game_request &game, const rated_move &response,
+    const std::vector<rated_move> &lines = {})
+{
+    logger::write(log_level::info, "move", {
+        { "move", protocol::to_uci(board, response.move) },
+        { "score", evaluation::to_string(response.value) }
+    });
+
+    return protocol::format_reply(board, game, response, lines);
+}
+
+// Parses a move request and answers it from the book or the result cache when they know
+// the move, text is left empty otherwise. The board only lives for this call: with its
+// repetition table it's too big to keep in a coroutine frame waiting for the engine, so
+// the search parses the request again
+request_error find_known_move(const std::string &body, move_request &request, std::string &text)
+{
+    chessboard board;
+    game_request &game = request.game;
+    rated_move response;
+
+    if (request_error error = protocol::parse(body, board, game); error != request_error::none)
+        return error;
+
+    logger::write(log_level::debug, "position", { { "board", board_digits(board) } });
+
+    request.hash = board.hash;
+    request.history_key = result_cache::history_key(game.history);
+
+    // Searches with other limits may have found other moves
+    request.history_key ^=
+        game.max_nodes * 0x9e3779b97f4a7c15ull ^
+        game.movetime * 0xbf58476d1ce4e5b9ull ^
+        game.deterministic * 0x94d049bb133111ebull;
+
+    // Mock searches should neither be skipped nor remembered
+    request.single_line = game.multipv == 1 && game.skill == max_skill && mock_search_cost < 0;
+
+    if (request.single_line && book::probe(board, response.move, book_max_ply, game.deterministic)) {
+        metrics::add(metrics::book_moves);
+        logger::write(log_level::info, "book_move");
+        text = move_reply(board, game, response);
+    }
+    else if (request.single_line &&
+        result_cache::lookup(board.hash, request.history_key, game.max_depth, game.max_time, response) &&
+        is_legal(board, response.move)) {
+        metrics::add(metrics::cached_results);
+        logger::write(log_level::info, "cached_result");
+        text = move_reply(board, game, response);
+    }
+
+    return request_error::none;
+}
+
+detached_task handle_move(const std::shared_ptr<Session> session)
 {
     const auto request = session->get_request();
+    const auto received = steady_clock::now();
 
     size_t content_length = request->get_header("Content-Length", 0);
 
-    session->fetch(content_length, [request](const std::shared_ptr<Session> session, const Bytes &body)
-    {
-        auto board = std::make_shared<chessboard>();
+    metrics::add(metrics::requests);
+
+    Bytes body = co_await fetch_body{ session, content_length };
+    std::string sbody((const char *)body.data(), body.size());
 
-        auto bye = [session](int code, std::string data) {
-            session->close(code, data.c_str(), {
-                { "Content-Length", std::to_string(data.length()) },
-                { "Connection", "close" },
-                { "Access-Control-Allow-Origin", "*" } 
-            });
-        };
+    logger::write(log_level::info, "request", { { "origin", session->get_origin() } });
 
-        std::string sbody = std::string((const char *)body.data(), body.size());
+    move_request parsed;
+    const game_request &game = parsed.game;
+    std::string text;
 
-        std::cout << "------------------------------\n";
-        std::cout << "Request from " << session->get_origin() << '\n';
+    if (request_error error = find_known_move(sbody, parsed, text); error != request_error::none) {
+        metrics::add(metrics::request_errors);
+        metrics::observe(metrics::request_latency, seconds_since(received));
+        reply(session, BAD_REQUEST, protocol::describe(error));
+        co_return;
+    }
 
-        std::istringstream iss(sbody);
-        char line[66] = {};
+    if (text.empty()) {
         rated_move response;
 
-        iss.getline(line, 65);
+        auto reached_depth = co_await on_engine([&] {
+            chessboard board;
+            game_request replayed;
+            protocol::parse(sbody, board, replayed);
+
+            int depth = 0;
+            std::vector<rated_move> lines;
+            run_search(board, response, request_limits(game), &depth, nullptr, &lines);
+            text = move_reply(board, game, response, lines);
+            return depth;
+        });
+
+        if (!reached_depth) {
+            metrics::add(metrics::request_errors);
+            metrics::observe(metrics::request_latency, seconds_since(received));
+            reply(session, SERVICE_UNAVAILABLE, "Engine busy");
+            co_return;
+        }
 
-        for (int i = 0; i < 64; i++) {
-            if (line[i] >= '0' && line[i] <= '9' || line[i] >= 'a' && line[i] <= 'f') {
-                int data = digit_hex_to_int(line[i]);
-                int type = data & type_mask, side = data >> side_shift;
+        if (parsed.single_line)
+            result_cache::store(parsed.hash, parsed.history_key, game.max_depth, game.max_time, response, *reached_depth);
+    }
 
-                board->pieces[i] = data;
+    metrics::observe(metrics::request_latency, seconds_since(received));
+    reply(session, OK, text);
+}
 
-                if (data) {
-                    board->side_sets[side] |= 1ull << i;
-                    board->piece_sets[type] |= 1ull << i;
+void process_move(const std::shared_ptr<Session> session)
+{
+    handle_move(session);
+}
 
-                    if ((side & 1) != side || type > pawn || type == 0) {
-                        bye(BAD_REQUEST, "Incorrect chess piece format");
-                        return;
-                    }
-                }
-            }
-            else {
-                bye(BAD_REQUEST, "Incorrect chess piece format");
-                return;
-            }
-        }
+// The rest of a batch result line for one "<FEN> [<UCI move> ...]" position, runs on the engine
+std::string analyze_position(const std::string &position, const game_request &limits)
+{
+    chessboard board;
+    std::vector<size_t> history;
 
-        int max_depth = 0, max_time = 0, moves = 0;
-        iss >> max_depth >> max_time >> moves;
+    if (request_error error = protocol::parse_position(position, board, history); error != request_error::none)
+        return std::string(",\"error\":\"") + protocol::describe(error) + "\"}\n";
 
-        if (max_depth <= 0 || max_depth > 64) {
-            bye(BAD_REQUEST, "Invalid maximum depth value");
-            return;
-        }
+    rated_move response;
+    std::vector<rated_move> lines;
+    int reached_depth = 0;
+    long long nodes = 0;
 
-        if (max_time <= 0 || max_time > 30) {
-            bye(BAD_REQUEST, "Invalid maximum time value");
-            return;
-        }
+    auto progress = [&nodes](int, const std::vector<rated_move> &, long long searched) { nodes = searched; };
 
-        chessmove m;
+    run_search(board, response, request_limits(limits), &reached_depth, progress, &lines);
 
-        // Initial hash for the board
-        board->hash = board->zobrist();
+    if (response.move.empty())
+        return ",\"error\":\"No legal moves\"}\n";
 
-        for (int i = 0; i < moves; i++) {
-            iss >> m.org_x >> m.org_y >> m.dest_x >> m.dest_y;
-            iss.ignore();
+    std::string line =
+        ",\"move\":\"" + protocol::to_uci(board, response.move) +
+        "\",\"score\":\"" + evaluation::to_string(response.value) +
+        "\",\"depth\":" + std::to_string(reached_depth) +
+        ",\"nodes\":" + std::to_string(nodes);
 
-            if (!board->valid_pos(m.org_x, m.org_y) ||
-                !board->valid_pos(m.dest_x, m.dest_y)) {
-                bye(BAD_REQUEST, "Incorrect move format");
-                return;
-            }
+    // Every candidate with its own score when more than one was asked for
+    if (limits.multipv > 1) {
+        line += ",\"lines\":[";
 
-            bits legal_moves[64] = { 0 };
+        // Skill levels below the maximum search extra lines to pick from, those stay out
+        for (size_t i = 0; i < lines.size() && i < size_t(limits.multipv); i++)
+            line += std::string(i ? "," : "") +
+                "{\"move\":\"" + protocol::to_uci(board, lines[i].move) +
+                "\",\"score\":\"" + evaluation::to_string(lines[i].value) + "\"}";
 
-            board->generate_moves(board->side_to_move, legal_moves);
+        line += "]";
+    }
 
-            if (~legal_moves[m.org_x + m.org_y * 8] & (1ull << m.dest_x + m.dest_y * 8)) {
-                bye(BAD_REQUEST, "Illegal move");
-                return;
-            }
+    return line + "}\n";
+}
 
-            board->make_move(m.org_x, m.org_y, m.dest_x, m.dest_y);
-        }
+// The body is "<depth> <time>" with the optional v2 limits followed by one "<FEN> [<UCI move> ...]" line per position.
+// Each position's line is sent as a chunk once it's searched, so results stream back while the rest is still queued
+// Positions are searched one after another on the engine thread with the server's engine instance, so the lines go
+// out in order as they finish and share its table. Each search splits its root moves over the whole worker pool instead
+detached_task handle_batch(const std::shared_ptr<Session> session)
+{
+    const auto request = session->get_request();
+
+    size_t content_length = request->get_header("Content-Length", 0);
+
+    Bytes body = co_await fetch_body{ session, content_length };
+    std::string_view text((const char *)body.data(), body.size());
+
+    game_request limits;
+    std::vector<std::string> positions;
 
-        board->print();
+    size_t end = text.find('\n');
+    std::string_view header = text.substr(0, end);
 
-        engine::iterative_deepening_negamax(*board, response, max_depth, max_time, evaluation::pesto, 5, 4);
+    if (request_error error = protocol::parse_limits(header, limits); error != request_error::none) {
+        reply(session, BAD_REQUEST, protocol::describe(error));
+        co_return;
+    }
 
-        std::ostringstream oss;
+    while (end != std::string_view::npos) {
+        size_t start = end + 1;
+        end = text.find('\n', start);
 
-        oss <<
-            response.move.org_x << ' ' << response.move.org_y << ' ' <<
-            response.move.dest_x << ' ' << response.move.dest_y;
+        std::string_view line = text.substr(start, end == std::string_view::npos ? text.npos : end - start);
 
-        auto ev = evaluation::to_string(response.value);
-        
-        std::printf("Output move: (%i, %i) -> (%i, %i), score = %s\n",
-            response.move.org_x, response.move.org_y,
-            response.move.dest_x, response.move.dest_y,
-            ev.c_str());
+        if (line.find_first_not_of(" \t\r") != std::string_view::npos)
+            positions.emplace_back(line);
+    }
 
-        bye(OK, oss.str());
+    if (positions.size() > max_batch_positions) {
+        reply(session, BAD_REQUEST, "Too many positions");
+        co_return;
+    }
+
+    logger::write(log_level::info, "batch", {
+        { "origin", session->get_origin() }, { "positions", positions.size() }
+    });
+
+    co_await written{ [&](auto done) {
+        session->yield(OK, "", {
+            { "Content-Type", "application/x-ndjson" },
+            { "Transfer-Encoding", "chunked" },
+            { "Connection", "close" },
+            { "Access-Control-Allow-Origin", "*" }
+        }, done);
+    } };
+
+    for (size_t index = 0; index < positions.size(); index++) {
+        std::string line = "{\"index\":" + std::to_string(index);
+
+        // Only the position's text waits in the frame, the board is built on the engine
+        if (auto result = co_await on_engine([&] { return analyze_position(positions[index], limits); }))
+            line += *result;
+        else
+            line += ",\"error\":\"Engine busy\"}\n";
+
+        std::ostringstream chunk;
+        chunk << std::hex << line.size() << "\r\n" << line << "\r\n";
+
+        co_await written{ [&](auto done) { session->yield(chunk.str(), done); } };
+    }
+
+    session->close(std::string("0\r\n\r\n"));
+}
+
+void process_batch(const std::shared_ptr<Session> session)
+{
+    handle_batch(session);
+}
+
+void process_metrics(const std::shared_ptr<Session> session)
+{
+    std::string text = metrics::render();
+
+    session->close(OK, text, {
+        { "Content-Length", std::to_string(text.length()) },
+        { "Content-Type", "text/plain; version=0.0.4" },
+        { "Connection", "close" }
     });
 }
 
 constexpr int file_count = sizeof file_paths / sizeof *file_paths;
 std::shared_ptr<Resource> files[file_count];
 
-int main(const int, const char **)
+int main(const int argc, const char **argv)
 {
-    init_lookups();
+    for (int i = 1; i < argc; i += 2) {
+        std::string option = argv[i];
+
+        if (option == "-mock-search" && i + 1 < argc)
+            mock_search_cost = std::max(std::atoi(argv[i + 1]), 0);
+        else {
+            std::printf("usage: ChessServer [-mock-search <ms>]\n");
+            return 1;
+        }
+    }
+
+    if (mock_search_cost >= 0)
+        std::printf("Mock search, every search takes %d ms\n", mock_search_cost);
+
+    bitbase::init();
+
+    if (!book::load_keys(book_keys_path) || !book::open(book_path))
+        std::printf("Opening book not loaded, searching from the first move\n");
+
+    if (!tablebase::init(tablebase_path, tablebase_max_pieces))
+        std::printf("Endgame tablebases not loaded\n");
 
     auto resource = std::make_shared<Resource>();
     resource->set_path("/chess_engine");
     resource->set_method_handler("POST", process_move);
 
+    auto batch_resource = std::make_shared<Resource>();
+    batch_resource->set_path("/analyze/batch");
+    batch_resource->set_method_handler("POST", process_batch);
+
+    auto metrics_resource = std::make_shared<Resource>();
+    metrics_resource->set_path("/metrics");
+    metrics_resource->set_method_handler("GET", process_metrics);
+
     for (int i = 0; i < file_count; i++) {
         files[i] = std::make_shared<Resource>();
         files[i]->set_path(file_paths[i]);
@@ -175,11 +569,72 @@ int main(const int, const char **)
 
     auto settings = std::make_shared<Settings>();
     settings->set_port(2023);
+    settings->set_connection_timeout(std::chrono::seconds(30));
+    settings->set_worker_limit(io_threads);
+
+    if (!assets::load(root_dir, file_paths, file_count))
+        std::printf("Failed to load static files from %s\n", root_dir.c_str());
+
+    result_cache::init(result_cache_size);
+
+    if (persist_result_cache && result_cache::load(result_cache_path))
+        std::printf("Loaded result cache\n");
+
+    bool warm = false;
+
+    engine::set_memory_policy(transposition_numa_policy);
+
+    if (persist_transpositions && engine::map_hash_file(transposition_path, transposition_megabytes, &warm))
+        std::printf(warm ? "Loaded transposition table\n" : "Created transposition table file\n");
+    else
+        engine::set_hash_size(transposition_megabytes);
 
     Service service;
+    service_executor service_io(service);
+    thread_executor search_thread(1);
+
+    io_executor = &service_io;
+    engine_executor = &search_thread;
+
+    logger::start(stdout, log_threshold);
+
+    auto shutdown = [&service, &search_thread](const int) {
+        engine_closed = true;
+
+        // A search that started before the flag was set clears the stop flag when it starts, so keep
+        // raising it until everything queued before this marker has run and the engine thread is free
+        std::promise<void> drained;
+        std::future<void> done = drained.get_future();
+        search_thread.post([&drained] { drained.set_value(); });
+
+        do
+            engine::stop();
+        while (done.wait_for(milliseconds(1)) != std::future_status::ready);
+
+        if (persist_result_cache)
+            result_cache::save(result_cache_path);
+        if (persist_transpositions)
+            engine::flush_hash_file();
+        service.stop();
+        logger::stop();
+    };
+
+    service.set_signal_handler(SIGINT, shutdown);
+    service.set_signal_handler(SIGTERM, shutdown);
+
+#ifdef SIGHUP
+    // Static files are only reread on request, a failed reload keeps serving the old ones
+    service.set_signal_handler(SIGHUP, [](const int) {
+        if (!assets::load(root_dir, file_paths, file_count))
+            logger::write(log_level::error, "assets_reload_failed");
+    });
+#endif
     service.publish(resource);
+    service.publish(batch_resource);
+    service.publish(metrics_resource);
     for (int i = 0; i < file_count; i++) service.publish(files[i]);
     service.start(settings);
+    logger::stop();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "tablebase.hh"
+#include <mutex>
+
+#ifdef USE_SYZYGY
+#include "tbprobe.h"
+#endif
+
+// Lock-free cache of probe results: the upper bits hold the hash, the low 3 bits wdl + 3
+constexpr int wdl_cache_size = 1 << 20;
+fastmap<std::atomic<size_t>, wdl_cache_size> wdl_cache;
+int piece_limit = 0;
+std::mutex root_probe_lock;
+
+int tablebase::max_pieces() {
+    return piece_limit;
+}
+
+#ifdef USE_SYZYGY
+bool tablebase::init(const std::string &path, int max_pieces) {
+    if (!tb_init(path.c_str()) || !TB_LARGEST)
+        return false;
+
+    piece_limit = std::min(int(TB_LARGEST), max_pieces);
+    return true;
+}
+
+// Fathom numbers squares from a1, while y = 0 is the eighth rank here
+inline uint64_t to_fathom(bits b) {
+#ifdef _MSC_VER
+    return _byteswap_uint64(b);
+#else
+    return __builtin_bswap64(b);
+#endif
+}
+
+inline unsigned en_passant_square(const chessboard &board) {
+    if (!board.en_passant)
+        return 0;
+
+    return (board.en_passant & 7) + (7 - (board.en_passant >> 3)) * 8;
+}
+
+bool tablebase::probe_wdl(const chessboard &board, int &result) {
+    // Tables don't cover positions with castling rights
+    if (int(__popcnt64(board.side_sets[0] | board.side_sets[1])) > piece_limit || board.castling)
+        return false;
+
+    std::atomic<size_t> &slot = wdl_cache[board.hash];
+    size_t cached = slot.load(std::memory_order_relaxed);
+
+    if (cached && (cached ^ board.hash) >> 3 == 0) {
+        result = int(cached & 7) - 3;
+        return true;
+    }
+
+    unsigned r = tb_probe_wdl(
+        to_fathom(board.side_sets[1]), to_fathom(board.side_sets[0]),
+        to_fathom(board.piece_sets[king]), to_fathom(board.piece_sets[queen]),
+        to_fathom(board.piece_sets[rook]), to_fathom(board.piece_sets[bishop]),
+        to_fathom(board.piece_sets[knight]), to_fathom(board.piece_sets[pawn]),
+        0, 0, en_passant_square(board), board.side_to_move == 1);
+
+    if (r == TB_RESULT_FAILED)
+        return false;
+
+    result = int(r) - 2;
+    slot.store(board.hash & ~7ull | size_t(result + 3), std::memory_order_relaxed);
+    return true;
+}
+
+bool tablebase::probe_root(const chessboard &board, chessmove &move, int &result) {
+    if (int(__popcnt64(board.side_sets[0] | board.side_sets[1])) > piece_limit || board.castling)
+        return false;
+
+    std::lock_guard<std::mutex> guard(root_probe_lock);
+
+    unsigned r = tb_probe_root(
+        to_fathom(board.side_sets[1]), to_fathom(board.side_sets[0]),
+        to_fathom(board.piece_sets[king]), to_fathom(board.piece_sets[queen]),
+        to_fathom(board.piece_sets[rook]), to_fathom(board.piece_sets[bishop]),
+        to_fathom(board.piece_sets[knight]), to_fathom(board.piece_sets[pawn]),
+        0, 0, en_passant_square(board), board.side_to_move == 1, nullptr);
+
+    if (r == TB_RESULT_FAILED || r == TB_RESULT_CHECKMATE || r == TB_RESULT_STALEMATE)
+        return false;
+
+    // Underpromotions can't be played, we always promote to a queen
+    if (TB_GET_PROMOTES(r) != TB_PROMOTES_NONE && TB_GET_PROMOTES(r) != TB_PROMOTES_QUEEN)
+        return false;
+
+    unsigned from = TB_GET_FROM(r), to = TB_GET_TO(r);
+
+    move = chessmove();
+    move.org_x = from & 7, move.org_y = 7 - (from >> 3);
+    move.dest_x = to & 7, move.dest_y = 7 - (to >> 3);
+    result = int(TB_GET_WDL(r)) - 2;
+    return true;
+}
+#else
+bool tablebase::init(const std::string &, int) {
+    return false;
+}
+
+bool tablebase::probe_wdl(const chessboard &, int &) {
+    return false;
+}
+
+bool tablebase::probe_root(const chessboard &, chessmove &, int &) {
+    return false;
+}
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+#include "chess.hh"
+
+// Syzygy endgame tablebase probing.
+// Probing goes through the Fathom library (tbprobe.h/tbprobe.c), which memory-maps
+// the .rtbw/.rtbz files itself; build with USE_SYZYGY and Fathom's sources on the
+// include path to enable it, otherwise every probe simply fails.
+namespace tablebase
+{
+    enum wdl_result : int {
+        loss = -2, blessed_loss = -1, draw = 0, cursed_win = 1, win = 2
+    };
+
+    // Scores for tablebase wins, kept just below the checkmate range
+    constexpr int win_score = INT_MAX - 512;
+
+    bool init(const std::string &path, int max_pieces = 6);
+
+    // Largest piece count that can be probed, 0 when no tables are loaded
+    int max_pieces();
+
+    // Win/draw/loss from the point of view of the side to move, cached by Zobrist hash
+    bool probe_wdl(const chessboard &board, int &result);
+
+    // Best move by distance to zeroing, for use at the root only
+    bool probe_root(const chessboard &board, chessmove &move, int &result);
+
+    inline int wdl_to_score(int wdl, int ply) {
+        return wdl == win ? win_score - ply : wdl == loss ? -win_score + ply : 0;
+    }
+}
@@ -0,0 +1,169 @@
+#include "task_scheduler.hh"
+#include <algorithm>
+#include <utility>
+
+// The scheduler and deque the current thread works for, if any
+thread_local task_scheduler *current_scheduler = nullptr;
+thread_local int current_queue = -1;
+
+task_scheduler::task_scheduler(int workers)
+{
+    workers = std::max(workers, 0);
+
+    for (int i = 0; i <= workers; i++)
+        queues.push_back(std::make_unique<task_queue>());
+
+    for (int i = 0; i < workers; i++)
+        this->workers.emplace_back(&task_scheduler::work, this, i);
+}
+
+task_scheduler::~task_scheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void task_scheduler::push(task t)
+{
+    int index = current_scheduler == this ? current_queue : int(queues.size()) - 1;
+
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->lock);
+        queues[index]->tasks.push_back(std::move(t));
+    }
+
+    pending++;
+
+    // Taking the lock orders this against a worker checking pending before it sleeps
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+
+        if (joining)
+            joined.notify_all();
+    }
+
+    wake.notify_one();
+}
+
+bool task_scheduler::pop(task_queue &queue, bool newest, task &t)
+{
+    std::lock_guard<std::mutex> lock(queue.lock);
+
+    if (queue.tasks.empty())
+        return false;
+
+    if (newest) {
+        t = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+    }
+    else {
+        t = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+    }
+
+    pending--;
+    return true;
+}
+
+bool task_scheduler::run_one()
+{
+    int count = int(queues.size());
+    int own = current_scheduler == this ? current_queue : -1;
+    task t;
+
+    // Own work first, depth first, then the oldest and so biggest task of someone else
+    bool found = own >= 0 && pop(*queues[own], true, t);
+
+    for (int i = 1; !found && i <= count; i++)
+        found = pop(*queues[(std::max(own, 0) + i) % count], false, t);
+
+    if (found)
+        t();
+
+    return found;
+}
+
+void task_scheduler::work(int index)
+{
+    current_scheduler = this;
+    current_queue = index;
+
+    while (!stopping) {
+        if (run_one())
+            continue;
+
+        std::unique_lock<std::mutex> lock(sleep_lock);
+        wake.wait(lock, [this] { return stopping || pending > 0; });
+    }
+}
+
+void task_group::run(std::function<void()> f)
+{
+    remaining++;
+
+    scheduler.push([this, f = std::move(f)] {
+        if (!failed) {
+            try {
+                f();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(error_lock);
+
+                if (!error)
+                    error = std::current_exception();
+
+                failed = true;
+            }
+        }
+
+        // The group may be gone right after this, only the scheduler is left to touch
+        task_scheduler &owner = scheduler;
+
+        if (--remaining == 0) {
+            std::lock_guard<std::mutex> lock(owner.sleep_lock);
+
+            if (owner.joining)
+                owner.joined.notify_all();
+        }
+    });
+}
+
+// Yields before a joining thread with nothing to run goes to sleep
+constexpr int join_spins = 64;
+
+void task_group::join()
+{
+    for (int spins = 0; remaining > 0;) {
+        if (scheduler.run_one()) {
+            spins = 0;
+            continue;
+        }
+
+        if (++spins < join_spins) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // The last task of the group to finish and every push wake the thread up
+        std::unique_lock<std::mutex> lock(scheduler.sleep_lock);
+        scheduler.joining++;
+        scheduler.joined.wait(lock, [this] { return remaining == 0 || scheduler.pending > 0; });
+        scheduler.joining--;
+        spins = 0;
+    }
+}
+
+void task_group::wait()
+{
+    join();
+
+    if (error)
+        std::rethrow_exception(std::exchange(error, nullptr));
+}
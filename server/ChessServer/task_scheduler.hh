@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs tasks on a fixed set of worker threads. Every worker has a deque of its
+// own: it takes its newest task from the back and, when that runs dry, steals
+// the oldest task from the front of another deque. Big subtrees get split up
+// by whoever is idle instead of holding up a barrier. The search splits its
+// root moves with it, perft divide its subtrees and the match runner its games
+class task_scheduler {
+public:
+    using task = std::function<void()>;
+
+    // A thread waiting for a task_group runs tasks too, so a scheduler with
+    // n - 1 workers keeps n threads busy
+    explicit task_scheduler(int workers);
+    ~task_scheduler();
+
+    task_scheduler(const task_scheduler &) = delete;
+    task_scheduler &operator=(const task_scheduler &) = delete;
+
+    // Threads that run tasks, counting the one that waits
+    inline int concurrency() const { return int(workers.size()) + 1; }
+
+    // Runs one queued task on the calling thread, false if there was none
+    bool run_one();
+
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    // One per worker, the last one takes tasks forked by other threads
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+
+    // Queued tasks nobody has taken yet, idle workers sleep while it's 0
+    std::atomic<int> pending = 0;
+    std::atomic<bool> stopping = false;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+
+    // Threads asleep in task_group::join, woken when a group finishes or a task is queued
+    int joining = 0;
+    std::condition_variable joined;
+
+    friend class task_group;
+    void push(task t);
+    bool pop(task_queue &queue, bool newest, task &t);
+    void work(int index);
+};
+
+// Tasks forked from one place and joined there, tasks may fork groups of their own
+class task_group {
+public:
+    explicit task_group(task_scheduler &scheduler) : scheduler(scheduler) {}
+    inline ~task_group() { join(); }
+
+    void run(std::function<void()> f);
+
+    // Helps with queued tasks until every task of the group has finished, then
+    // rethrows the first exception one of them threw. Once a task has thrown,
+    // the group's tasks that haven't started yet are skipped
+    void wait();
+
+private:
+    task_scheduler &scheduler;
+    std::atomic<int> remaining = 0;
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+    std::mutex error_lock;
+
+    void join();
+};
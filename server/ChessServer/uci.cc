@@ -0,0 +1,435 @@
+#include "chess.hh"
+#include "search.hh"
+#include "bitbase.hh"
+#include "protocol.hh"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <chrono>
+
+using namespace std::chrono;
+
+const std::string start_fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+constexpr int default_hash_size = 256;
+constexpr int max_hash_size = 65536;
+constexpr int max_threads = 256;
+
+// Kept back from every clock so the move arrives in time
+constexpr int move_overhead = 30;
+constexpr int default_moves_to_go = 30;
+
+struct go_limits {
+    int depth = 64, movetime = 0;
+    long long nodes = 0;
+    int time[2] = { 0, 0 }, inc[2] = { 0, 0 }, moves_to_go = 0;
+    bool infinite = false, ponder = false;
+};
+
+std::string uci_position = start_fen;
+eval_func uci_eval = evaluation::pesto;
+int uci_multipv = 1, uci_skill = max_skill;
+
+std::thread searcher, search_clock;
+std::mutex uci_state_lock, uci_output_lock;
+std::condition_variable uci_state_changed;
+bool searching = false, stop_requested = false, pondering = false, infinite_search = false;
+steady_clock::time_point search_start, search_deadline;
+int search_budget = 0;
+
+void send(const std::string &line)
+{
+    std::lock_guard<std::mutex> lock(uci_output_lock);
+    std::cout << line << std::endl;
+}
+
+std::string uci_score(int value)
+{
+    return value >= INT_MAX - 256 ? "mate " + std::to_string((INT_MAX - value + 1) / 2) :
+        value <= -INT_MAX + 256 ? "mate -" + std::to_string((value + INT_MAX + 1) / 2) :
+        "cp " + std::to_string(value);
+}
+
+// Share of the remaining clock spent on this move, 0 means no limit
+int time_budget(const go_limits &limits, int side)
+{
+    if (limits.movetime)
+        return std::max(limits.movetime - move_overhead, 1);
+
+    if (!limits.time[side])
+        return 0;
+
+    int moves_to_go = limits.moves_to_go ? limits.moves_to_go : default_moves_to_go;
+    int budget = limits.time[side] / moves_to_go + limits.inc[side] * 3 / 4;
+
+    return std::max(std::min(budget, limits.time[side] - move_overhead), 1);
+}
+
+// Stops the search once its budget runs out or a stop is requested. The engine
+// clears its stop flag when a search starts, so keep raising it until it's done
+void run_clock()
+{
+    std::unique_lock<std::mutex> lock(uci_state_lock);
+
+    while (searching) {
+        bool timed = !pondering && search_budget;
+
+        if (stop_requested || timed && steady_clock::now() >= search_deadline) {
+            engine::stop();
+            uci_state_changed.wait_for(lock, milliseconds(1));
+        }
+        else if (timed)
+            uci_state_changed.wait_until(lock, search_deadline);
+        else
+            uci_state_changed.wait(lock);
+    }
+}
+
+void run_search(chessboard board, search_limits limits)
+{
+    rated_move result;
+
+    // Called between iterations, with the root position on the board
+    auto progress = [&board, &limits](int depth, const std::vector<rated_move> &lines, long long nodes) {
+        long long elapsed = duration_cast<milliseconds>(steady_clock::now() - search_start).count();
+
+        // Only the MultiPV lines, a lower Skill Level has the search look at more
+        for (size_t i = 0; i < lines.size() && i < size_t(std::max(limits.multipv, 1)); i++) {
+            std::ostringstream oss;
+
+            oss << "info depth " << depth << " multipv " << i + 1 << " score " << uci_score(lines[i].value) <<
+                " nodes " << nodes << " nps " << nodes * 1000 / std::max(elapsed, 1ll) <<
+                " time " << elapsed << " pv " << protocol::to_uci(board, lines[i].move);
+
+            send(oss.str());
+        }
+    };
+
+    engine::iterative_deepening_negamax(board, result, limits, uci_eval, nullptr, progress);
+
+    // Without a stop command the best move can't be sent while pondering or in infinite mode
+    std::unique_lock<std::mutex> lock(uci_state_lock);
+    uci_state_changed.wait(lock, [] { return stop_requested || !pondering && !infinite_search; });
+
+    send("bestmove " + (result.move.empty() ? std::string("0000") : protocol::to_uci(board, result.move)));
+
+    searching = false;
+    uci_state_changed.notify_all();
+}
+
+void stop_search()
+{
+    {
+        std::lock_guard<std::mutex> lock(uci_state_lock);
+        stop_requested = true;
+        uci_state_changed.notify_all();
+    }
+
+    if (searcher.joinable())
+        searcher.join();
+
+    if (search_clock.joinable())
+        search_clock.join();
+}
+
+bool setup_board(chessboard &board)
+{
+    std::vector<size_t> history;
+
+    if (protocol::parse_position(uci_position, board, history) != request_error::none) {
+        send("info string invalid position");
+        return false;
+    }
+
+    return true;
+}
+
+void process_position(std::istringstream &iss)
+{
+    std::string token, fen;
+
+    iss >> token;
+
+    if (token == "startpos") {
+        fen = start_fen;
+        iss >> token;
+    }
+    else if (token == "fen") {
+        while (iss >> token && token != "moves")
+            fen += token + ' ';
+    }
+    else
+        return;
+
+    // Moves after the "moves" keyword are appended to the FEN
+    std::string moves;
+    std::getline(iss, moves);
+
+    uci_position = fen + ' ' + moves;
+}
+
+void process_go(std::istringstream &iss)
+{
+    go_limits limits;
+    std::string token;
+
+    while (iss >> token) {
+        if (token == "depth") iss >> limits.depth;
+        else if (token == "nodes") iss >> limits.nodes;
+        else if (token == "movetime") iss >> limits.movetime;
+        else if (token == "wtime") iss >> limits.time[1];
+        else if (token == "btime") iss >> limits.time[0];
+        else if (token == "winc") iss >> limits.inc[1];
+        else if (token == "binc") iss >> limits.inc[0];
+        else if (token == "movestogo") iss >> limits.moves_to_go;
+        else if (token == "infinite") limits.infinite = true;
+        else if (token == "ponder") limits.ponder = true;
+    }
+
+    chessboard board;
+
+    if (!setup_board(board))
+        return;
+
+    limits.depth = std::max(std::min(limits.depth, 64), 1);
+
+    searching = true;
+    stop_requested = false;
+    pondering = limits.ponder;
+    infinite_search = limits.infinite;
+    search_budget = limits.infinite ? 0 : time_budget(limits, board.side_to_move);
+    search_start = steady_clock::now();
+    search_deadline = search_start + milliseconds(search_budget);
+
+    // The clock thread decides when time is up, the engine only counts depth and nodes
+    search_limits engine_limits;
+    engine_limits.depth = limits.depth;
+    engine_limits.movetime = 0;
+    engine_limits.nodes = limits.nodes;
+    engine_limits.multipv = uci_multipv;
+    engine_limits.skill = uci_skill;
+
+    searcher = std::thread(run_search, board, engine_limits);
+    search_clock = std::thread(run_clock);
+}
+
+// Counts the leaves below the position, taking moves back either way
+size_t perft(chessboard &board, int depth, bool copy_make)
+{
+    if (!depth)
+        return 1;
+
+    bits moves[64] = { 0 };
+    size_t nodes = 0;
+    unsigned long dest;
+
+    board.generate_moves(board.side_to_move, moves);
+
+    for (int org = 0; org < 64; org++) {
+        for (bits set = moves[org]; set; set &= set - 1) {
+            _BitScanForward64(&dest, set);
+
+            board_state saved = board;
+            board.make_move(org & 7, org >> 3, dest & 7, dest >> 3);
+            nodes += perft(board, depth - 1, copy_make);
+
+            if (copy_make)
+                board.restore(saved);
+            else
+                board.unmake_move();
+        }
+    }
+
+    return nodes;
+}
+
+// Subtrees this shallow are counted by one thread, deeper ones are split into a task per move
+constexpr int perft_split_depth = 3;
+
+// Counts the leaves below every move with the engine's threads, subtrees of very
+// different sizes even out as idle threads steal the pending ones
+std::vector<std::pair<chessmove, size_t>> parallel_perft(task_scheduler &scheduler, const chessboard &board, int depth)
+{
+    std::vector<std::pair<chessmove, size_t>> counts;
+    bits moves[64] = { 0 };
+    unsigned long dest;
+
+    chessboard position = board;
+    position.generate_moves(position.side_to_move, moves);
+
+    for (int org = 0; org < 64; org++)
+        for (bits set = moves[org]; set; set &= set - 1) {
+            _BitScanForward64(&dest, set);
+            counts.push_back({ chessmove{ org & 7, org >> 3, int(dest & 7), int(dest >> 3) }, 0 });
+        }
+
+    task_group group(scheduler);
+
+    for (auto &count : counts) {
+        group.run([&] {
+            chessboard child = board;
+            child.make_move(count.first.org_x, count.first.org_y, count.first.dest_x, count.first.dest_y);
+
+            if (depth - 1 <= perft_split_depth)
+                count.second = perft(child, depth - 1, true);
+            else
+                for (auto &below : parallel_perft(scheduler, child, depth - 1))
+                    count.second += below.second;
+        });
+    }
+
+    group.wait();
+    return counts;
+}
+
+void send_perft(const char *method, size_t nodes, long long elapsed)
+{
+    send(std::string("info string perft ") + method +
+        " nodes " + std::to_string(nodes) + " time " + std::to_string(elapsed) +
+        " nps " + std::to_string(nodes * 1000 / std::max(elapsed, 1ll)));
+}
+
+// "perft <depth>" compares unmake_move with copy-make on the current position and
+// times the threaded count, "perft <depth> divide" lists the count below every move
+void process_perft(std::istringstream &iss)
+{
+    int depth = 5;
+    std::string mode;
+    iss >> depth >> mode;
+    depth = std::max(depth, 1);
+
+    chessboard board;
+
+    if (!setup_board(board))
+        return;
+
+    if (mode != "divide") {
+        for (bool copy_make : { false, true }) {
+            chessboard copy = board;
+
+            auto start = steady_clock::now();
+            size_t nodes = perft(copy, depth, copy_make);
+            send_perft(copy_make ? "copy-make" : "unmake", nodes,
+                duration_cast<milliseconds>(steady_clock::now() - start).count());
+        }
+    }
+
+    auto start = steady_clock::now();
+    size_t nodes = 0;
+
+    for (auto &count : parallel_perft(engine::workers(), board, depth)) {
+        if (mode == "divide")
+            send("info string " + protocol::to_uci(board, count.first) + " " + std::to_string(count.second));
+
+        nodes += count.second;
+    }
+
+    send_perft("threads", nodes, duration_cast<milliseconds>(steady_clock::now() - start).count());
+}
+
+void process_ponderhit()
+{
+    std::lock_guard<std::mutex> lock(uci_state_lock);
+
+    // The opponent played the expected move, the clock starts now
+    pondering = false;
+    search_deadline = steady_clock::now() + milliseconds(search_budget);
+    uci_state_changed.notify_all();
+}
+
+void process_setoption(std::istringstream &iss)
+{
+    std::string token, name, value;
+
+    iss >> token;
+
+    while (iss >> token && token != "value")
+        name += (name.empty() ? "" : " ") + token;
+
+    iss >> value;
+
+    if (name == "Hash")
+        engine::set_hash_size(std::max(std::min(std::atoi(value.c_str()), max_hash_size), 1));
+    else if (name == "Threads")
+        engine::set_threads(std::max(std::min(std::atoi(value.c_str()), max_threads), 1));
+    else if (name == "MultiPV")
+        uci_multipv = std::max(std::min(std::atoi(value.c_str()), max_multipv), 1);
+    else if (name == "Skill Level")
+        uci_skill = std::max(std::min(std::atoi(value.c_str()), max_skill), 0);
+    // Pondering only needs go ponder, the option just tells the GUI it may send it
+    else if (name == "Ponder") {}
+    else if (name == "EvalFunction") {
+        if (value == "simplified")
+            uci_eval = evaluation::simplified;
+        else if (value == "proper")
+            uci_eval = evaluation::proper;
+        else
+            uci_eval = evaluation::pesto;
+    }
+    else
+        send("info string unknown option " + name);
+}
+
+int main(const int, const char **)
+{
+    bitbase::init();
+
+    engine::set_interactive(false);
+    engine::set_hash_size(default_hash_size);
+
+    std::string line, command;
+
+    while (std::getline(std::cin, line)) {
+        std::istringstream iss(line);
+
+        if (!(iss >> command))
+            continue;
+
+        if (command == "uci") {
+            send("id name web-chess");
+            send("id author nokiiaa");
+            send("option name Hash type spin default " + std::to_string(default_hash_size) +
+                " min 1 max " + std::to_string(max_hash_size));
+            send("option name Threads type spin default " + std::to_string(std::thread::hardware_concurrency()) +
+                " min 1 max " + std::to_string(max_threads));
+            send("option name MultiPV type spin default 1 min 1 max " + std::to_string(max_multipv));
+            send("option name Skill Level type spin default " + std::to_string(max_skill) +
+                " min 0 max " + std::to_string(max_skill));
+            send("option name EvalFunction type combo default pesto var simplified var proper var pesto");
+            send("option name Ponder type check default false");
+            send("uciok");
+        }
+        else if (command == "isready")
+            send("readyok");
+        else if (command == "ucinewgame") {
+            stop_search();
+            engine::clear();
+        }
+        else if (command == "setoption") {
+            stop_search();
+            process_setoption(iss);
+        }
+        else if (command == "position") {
+            stop_search();
+            process_position(iss);
+        }
+        else if (command == "go") {
+            stop_search();
+            process_go(iss);
+        }
+        else if (command == "stop")
+            stop_search();
+        else if (command == "ponderhit")
+            process_ponderhit();
+        else if (command == "perft") {
+            stop_search();
+            process_perft(iss);
+        }
+        else if (command == "quit")
+            break;
+    }
+
+    stop_search();
+    return 0;
+}